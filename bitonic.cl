@@ -1,6 +1,8 @@
 #line 2 "bitonic.cl"
-void check(__global T *ary, uint a, uint b);
-void check(__global T *ary, uint a, uint b) {
+// IDX is the index type, offset the global id of the first work item of
+// the launch (see OpenCLApp::run_kernel_tiled)
+void check(__global T *ary, IDX a, IDX b);
+void check(__global T *ary, IDX a, IDX b) {
   T x = ary[a], y = ary[b];
   if (less(y, x)) {
     ary[a] = y;
@@ -9,30 +11,30 @@ void check(__global T *ary, uint a, uint b) {
 }
 __kernel void bitonic_cross(
     __global T *ary,
-    uint size,
-    uint offset,
-    uint i
+    ulong size,
+    ulong offset,
+    ulong i_
 )
 {
-  uint item = get_global_id(0) + offset;
+  IDX item = get_global_id(0) + offset, i = i_;
   if (item >= size / 2) return;
-  uint l = item/i*i*2, r = l + 2*i - 1, idx = i - 1 - item % i;
-  uint a = l + idx, b = r - idx;
+  IDX l = item/i*i*2, r = l + 2*i - 1, idx = i - 1 - item % i;
+  IDX a = l + idx, b = r - idx;
   if (b >= size) return;
   check(ary, a, b);
 }
 
 __kernel void bitonic_inc(
     __global T *ary,
-    uint size,
-    uint offset,
-    uint j
+    ulong size,
+    ulong offset,
+    ulong j_
 )
 {
-  uint item = get_global_id(0) + offset;
+  IDX item = get_global_id(0) + offset, j = j_;
   if (item >= size / 2) return;
-  uint l = item/j*j*2, idx = item % j;
-  uint a = l + idx, b = l + j + idx;
+  IDX l = item/j*j*2, idx = item % j;
+  IDX a = l + idx, b = l + j + idx;
   if (b >= size) return;
   check(ary, a, b);
 }
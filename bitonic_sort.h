@@ -17,47 +17,35 @@ namespace ocl_primitives {
   void bitonic_sort(
       OpenCLApp& cl,
       const OpenCLConfig& clcfg,
-      cl::Buffer buf, uint32_t size,
+      cl::Buffer buf, uint64_t size,
       const std::string& type, const std::string& comp)
   {
     //double t0 = utils::get_time();
-    static std::map<std::tuple<std::string, std::string>,
-      std::tuple<cl::Kernel, cl::Kernel>> memo;
-    auto it = memo.find(std::tie(type, comp));
-    cl::Kernel kernel_cross, kernel_inc;
-    if (it == std::end(memo)) {
-      auto defines = std::string()
-        + "#define T " + type + "\n"
-        + "bool less(T x, T y);\n"
-        + "bool less(T x, T y) { return (" + comp + "); }\n";
-      auto prog = cl.build_program(std::vector<std::string> {
-        defines,
-        ocl_code::bitonic_cl_str
-      });
-      kernel_cross = cl.get_kernel(prog, "bitonic_cross");
-      kernel_inc = cl.get_kernel(prog, "bitonic_inc");
-      memo[std::tie(type, comp)] = std::tie(kernel_cross, kernel_inc);
-    } else {
-      std::tie(kernel_cross, kernel_inc) = it->second;
-    }
+    // indices go up to twice the size
+    std::string idx = OpenCLApp::index_type(2 * size);
+    auto defines = std::string()
+      + "#define T " + type + "\n"
+      + "#define IDX " + idx + "\n"
+      + "bool less(T x, T y);\n"
+      + "bool less(T x, T y) { return (" + comp + "); }\n";
+    auto prog = cl.build_program(std::vector<std::string> {
+      defines,
+      ocl_code::bitonic_cl_str
+    });
+    cl::Kernel kernel_cross = cl.get_kernel(prog, "bitonic_cross");
+    cl::Kernel kernel_inc = cl.get_kernel(prog, "bitonic_inc");
     kernel_cross.setArg(0, buf);
-    kernel_cross.setArg(1, (cl_uint)size);
-    kernel_cross.setArg(2, (cl_uint)0);
+    kernel_cross.setArg(1, (cl_ulong)size);
     kernel_inc.setArg(0, buf);
-    kernel_inc.setArg(1, (cl_uint)size);
-    kernel_inc.setArg(2, (cl_uint)0);
+    kernel_inc.setArg(1, (cl_ulong)size);
     //std::cout << "loading time " << utils::get_time()-t0 << std::endl;
-    for (uint32_t i = 1; i < size; i <<= 1) {
+    for (uint64_t i = 1; i < size; i <<= 1) {
       //t0 = utils::get_time();
-      kernel_cross.setArg(3, (cl_uint)i);
-      uint32_t global_size = utils::round_to_multiple(size/2, clcfg.local_size);
-      cl.run_kernel(kernel_cross,
-          cl::NDRange(global_size), cl::NDRange(clcfg.local_size));
-      for (uint32_t j = i/2; j >= 1; j >>= 1) {
-        kernel_inc.setArg(3, (cl_uint)j);
-        uint32_t global_size = utils::round_to_multiple(size/2, clcfg.local_size);
-        cl.run_kernel(kernel_inc,
-            cl::NDRange(global_size), cl::NDRange(clcfg.local_size));
+      kernel_cross.setArg(3, (cl_ulong)i);
+      cl.run_kernel_tiled(kernel_cross, 2, size/2, clcfg.local_size);
+      for (uint64_t j = i/2; j >= 1; j >>= 1) {
+        kernel_inc.setArg(3, (cl_ulong)j);
+        cl.run_kernel_tiled(kernel_inc, 2, size/2, clcfg.local_size);
       }
       //std::cout << i << " " << utils::get_time()-t0 << std::endl;
     }
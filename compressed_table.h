@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+// Array of integers of a fixed bit width
+struct PackedArray {
+  int width = 0;
+  std::vector<std::uint64_t> words;
+
+  void init(std::uint64_t num, int width_) {
+    width = width_;
+    // one word of padding, so that get() can always read two words
+    words.assign((num * width + 63) / 64 + 1, 0);
+  }
+
+  void set(std::uint64_t i, std::uint64_t x) {
+    if (!width)
+      return;
+    std::uint64_t pos = i * width, bit = pos % 64;
+    words[pos / 64] |= x << bit;
+    if (bit + width > 64)
+      words[pos / 64 + 1] |= x >> (64 - bit);
+  }
+
+  std::uint64_t get(std::uint64_t i) const {
+    if (!width)
+      return 0;
+    std::uint64_t pos = i * width, bit = pos % 64;
+    std::uint64_t x = words[pos / 64] >> bit;
+    if (bit + width > 64)
+      x |= words[pos / 64 + 1] << (64 - bit);
+    return width == 64 ? x : x & ((std::uint64_t{1} << width) - 1);
+  }
+};
+
+// Compact representation of a sorted, duplicate-free table. The endpoints
+// are Elias-Fano coded: the low `low_bits` bits of every endpoint are stored
+// verbatim, the remaining high part h of the i-th endpoint sets bit h + i of
+// the `highs` bit vector, so every bucket of endpoints with the same high
+// part is a run of ones terminated by a zero. The start values are stored
+// relative to the first start of the table, in as many bits as the largest
+// of them needs. Every SAMPLE-th bucket has its position in `highs` sampled,
+// so finding a bucket only needs a short scan.
+struct CompressedTable {
+  using Entry = std::pair<std::uint64_t, std::uint64_t>;
+  static const std::uint64_t SAMPLE = 256;
+
+  std::uint64_t num = 0, universe = 0, low_bits = 0, start_base = 0;
+  PackedArray lows, starts;
+  std::vector<std::uint64_t> highs, bucket_pos;
+
+  // entries must be sorted by endpoint, without duplicate endpoints, and
+  // all endpoints must be < universe
+  void build(const Entry* entries, std::uint64_t n, std::uint64_t universe_,
+      std::uint64_t start_base_)
+  {
+    num = n;
+    universe = universe_;
+    start_base = start_base_;
+    low_bits = universe > num && num ? utils::bit_width(universe / num) - 1 : 0;
+    std::uint64_t max_start = 0;
+    for (std::uint64_t i = 0; i < n; ++i) {
+      assert(entries[i].second >= start_base);
+      max_start = std::max(max_start, entries[i].second - start_base);
+    }
+    std::uint64_t buckets = num_buckets();
+    lows.init(n, low_bits);
+    starts.init(n, utils::bit_width(max_start));
+    highs.assign((n + buckets + 63) / 64 + 1, 0);
+    bucket_pos.clear();
+    std::uint64_t idx = 0;
+    for (std::uint64_t h = 0; h <= buckets; h += SAMPLE) {
+      while (idx < n && (entries[idx].first >> low_bits) < h)
+        idx++;
+      bucket_pos.push_back(h + idx);
+    }
+    for (std::uint64_t i = 0; i < n; ++i) {
+      assert(entries[i].first < universe);
+      assert(i == 0 || entries[i - 1].first < entries[i].first);
+      std::uint64_t pos = (entries[i].first >> low_bits) + i;
+      highs[pos / 64] |= std::uint64_t{1} << (pos % 64);
+      lows.set(i, entries[i].first & low_mask());
+      starts.set(i, entries[i].second - start_base);
+    }
+  }
+
+  std::uint64_t size() const { return num; }
+
+  std::uint64_t bytes() const {
+    return 8 * (lows.words.size() + starts.words.size()
+        + highs.size() + bucket_pos.size());
+  }
+
+  // Finds the start of the chain ending in endpoint, without decompressing
+  // more than the bucket of the endpoint.
+  bool find(std::uint64_t endpoint, std::uint64_t& start) const {
+    if (endpoint >= universe)
+      return false;
+    std::uint64_t h = endpoint >> low_bits, low = endpoint & low_mask();
+    // skip over h % SAMPLE zeros from the sampled bucket position
+    std::uint64_t pos = bucket_pos[h / SAMPLE];
+    for (std::uint64_t skip = h % SAMPLE; skip; ) {
+      std::uint64_t zeros = ~highs[pos / 64] >> (pos % 64);
+      std::uint64_t avail = 64 - pos % 64;
+      if (avail < 64)
+        zeros &= (std::uint64_t{1} << avail) - 1;
+      std::uint64_t z = __builtin_popcountll(zeros);
+      if (z < skip) {
+        skip -= z;
+        pos += avail;
+        continue;
+      }
+      while (--skip)
+        zeros &= zeros - 1;
+      pos += __builtin_ctzll(zeros) + 1;
+    }
+    // pos is now the first position of bucket h
+    for (; highs[pos / 64] >> (pos % 64) & 1; ++pos) {
+      std::uint64_t i = pos - h, l = lows.get(i);
+      if (l > low)
+        break;
+      if (l == low) {
+        start = starts.get(i) + start_base;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<Entry> decompress() const {
+    std::vector<Entry> res;
+    res.reserve(num);
+    for (std::uint64_t w = 0; w < highs.size() && res.size() < num; ++w) {
+      for (std::uint64_t bits = highs[w]; bits; bits &= bits - 1) {
+        std::uint64_t i = res.size();
+        std::uint64_t h = w * 64 + __builtin_ctzll(bits) - i;
+        res.emplace_back((h << low_bits) | lows.get(i),
+            starts.get(i) + start_base);
+      }
+    }
+    return res;
+  }
+
+  void save_to_disk(std::string filename) const {
+    std::ofstream f(filename);
+    f.write(MAGIC, sizeof MAGIC);
+    std::uint64_t header[] = {
+      num, universe, low_bits, start_base, (std::uint64_t)starts.width };
+    f.write((char*)header, sizeof header);
+    for (auto v : { &lows.words, &starts.words, &highs, &bucket_pos }) {
+      std::uint64_t size = v->size();
+      f.write((char*)&size, sizeof size);
+      f.write((char*)v->data(), size * sizeof (*v)[0]);
+    }
+  }
+
+  void read_from_disk(std::string filename) {
+    std::ifstream f(filename);
+    char magic[sizeof MAGIC];
+    f.read(magic, sizeof magic);
+    assert(f && std::equal(magic, magic + sizeof magic, MAGIC));
+    std::uint64_t header[5];
+    f.read((char*)header, sizeof header);
+    num = header[0];
+    universe = header[1];
+    low_bits = header[2];
+    start_base = header[3];
+    lows.width = low_bits;
+    starts.width = header[4];
+    for (auto v : { &lows.words, &starts.words, &highs, &bucket_pos }) {
+      std::uint64_t size;
+      f.read((char*)&size, sizeof size);
+      v->resize(size);
+      f.read((char*)v->data(), size * sizeof (*v)[0]);
+    }
+    assert(f);
+  }
+
+private:
+  static constexpr const char MAGIC[8] = { 'R', 'T', 'E', 'F', 0, 0, 0, 1 };
+
+  std::uint64_t low_mask() const {
+    return (std::uint64_t{1} << low_bits) - 1;
+  }
+
+  std::uint64_t num_buckets() const {
+    return universe ? ((universe - 1) >> low_bits) + 1 : 0;
+  }
+};
+
+constexpr const char CompressedTable::MAGIC[8];
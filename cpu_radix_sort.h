@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+namespace cpu_primitives {
+  using KeyValue = std::pair<std::uint64_t, std::uint64_t>;
+
+  namespace detail {
+    const int MAX_DIGIT_BITS = 11;
+    // below this many elements per thread, more threads don't pay off
+    const std::uint64_t MIN_PART_SIZE = 1 << 16;
+
+    unsigned num_parts(std::uint64_t n, unsigned num_threads) {
+      return std::max(std::uint64_t{1},
+          std::min(std::uint64_t{num_threads}, n / MIN_PART_SIZE));
+    }
+
+    // Parallel LSD radix sort. Every pass counts the digits of each part of
+    // the input on its own thread and then scatters the parts to their
+    // precomputed positions. With unique = true, the last pass only keeps
+    // the first of every run of equal keys.
+    void radix_sort(std::vector<KeyValue>& v, int bits, unsigned num_threads,
+        bool unique)
+    {
+      std::uint64_t n = v.size();
+      if (n == 0)
+        return;
+      int passes = std::max(1, (bits + MAX_DIGIT_BITS - 1) / MAX_DIGIT_BITS);
+      int digit_bits = std::max(1, (bits + passes - 1) / passes);
+      std::uint64_t radix = std::uint64_t{1} << digit_bits;
+      unsigned parts = num_parts(n, num_threads);
+      std::uint64_t part_size = (n + parts - 1) / parts;
+      std::vector<KeyValue> tmp(n);
+      // per part and digit: number of elements, later the output position
+      std::vector<std::uint64_t> count(parts * radix);
+      // per part and digit: first and last key, to find duplicates that
+      // straddle two parts
+      std::vector<std::uint64_t> first_key, last_key;
+      std::vector<char> skip_first;
+      std::uint64_t total = n;
+      for (int pass = 0; pass < passes; ++pass) {
+        int shift = pass * digit_bits;
+        bool dedup = unique && pass == passes - 1;
+        auto digit = [&](std::uint64_t key) {
+          return (key >> shift) & (radix - 1);
+        };
+        if (dedup) {
+          first_key.assign(parts * radix, 0);
+          last_key.assign(parts * radix, 0);
+          skip_first.assign(parts * radix, 0);
+        }
+
+        // In the last pass of a unique sort, the elements of a part that
+        // have the same digit are sorted by key, so duplicates within a part
+        // are always adjacent in that subsequence.
+        utils::parallel_for(parts, 0, n, part_size,
+            [&](unsigned, std::uint64_t lo, std::uint64_t hi) {
+          std::uint64_t part = lo / part_size;
+          std::uint64_t* c = &count[part * radix];
+          std::fill(c, c + radix, 0);
+          for (std::uint64_t i = lo; i < hi; ++i) {
+            std::uint64_t key = v[i].first, d = digit(key);
+            if (dedup) {
+              std::uint64_t slot = part * radix + d;
+              if (c[d] && last_key[slot] == key)
+                continue;
+              if (!c[d])
+                first_key[slot] = key;
+              last_key[slot] = key;
+            }
+            c[d]++;
+          }
+        });
+
+        std::uint64_t acc = 0;
+        for (std::uint64_t d = 0; d < radix; ++d) {
+          bool have_prev = false;
+          std::uint64_t prev = 0;
+          for (std::uint64_t part = 0; part < parts; ++part) {
+            std::uint64_t slot = part * radix + d;
+            std::uint64_t x = count[slot];
+            if (dedup && x) {
+              if (have_prev && first_key[slot] == prev) {
+                skip_first[slot] = 1;
+                x--;
+              }
+              have_prev = true;
+              prev = last_key[slot];
+            }
+            count[slot] = acc;
+            acc += x;
+          }
+        }
+        total = acc;
+
+        utils::parallel_for(parts, 0, n, part_size,
+            [&](unsigned, std::uint64_t lo, std::uint64_t hi) {
+          std::uint64_t part = lo / part_size;
+          std::uint64_t* pos = &count[part * radix];
+          std::vector<char> seen;
+          std::vector<std::uint64_t> prev;
+          if (dedup) {
+            seen.assign(radix, 0);
+            prev.assign(radix, 0);
+          }
+          for (std::uint64_t i = lo; i < hi; ++i) {
+            std::uint64_t key = v[i].first, d = digit(key);
+            if (dedup) {
+              bool first = !seen[d];
+              bool dup = first ? skip_first[part * radix + d] : prev[d] == key;
+              seen[d] = 1;
+              prev[d] = key;
+              if (dup)
+                continue;
+            }
+            tmp[pos[d]++] = v[i];
+          }
+        });
+        v.swap(tmp);
+      }
+      v.resize(total);
+    }
+  }
+
+  // Stable radix sort of (key, value) pairs by key. Only the lowest `bits`
+  // bits of the keys are looked at, so callers that know an upper bound on
+  // the keys save passes.
+  void radix_sort(std::vector<KeyValue>& v, int bits,
+      unsigned num_threads = utils::default_num_threads())
+  {
+    detail::radix_sort(v, bits, num_threads, false);
+  }
+
+  // Like radix_sort, but only keeps the first pair (in input order) of every
+  // key. Deduplication happens in the scatter of the last pass.
+  void radix_sort_unique(std::vector<KeyValue>& v, int bits,
+      unsigned num_threads = utils::default_num_threads())
+  {
+    detail::radix_sort(v, bits, num_threads, true);
+  }
+
+  // Sorts and deduplicates by key without a second buffer: an in-place MSD
+  // partition on the top digit, after which the buckets are sorted on their
+  // own in parallel. Of every key, the pair with the smallest value is kept.
+  void sort_unique_inplace(std::vector<KeyValue>& v, int bits,
+      unsigned num_threads = utils::default_num_threads())
+  {
+    std::uint64_t n = v.size();
+    if (n == 0)
+      return;
+    int digit_bits = std::min(bits, detail::MAX_DIGIT_BITS);
+    int shift = bits - digit_bits;
+    std::uint64_t radix = std::uint64_t{1} << digit_bits;
+    auto digit = [&](std::uint64_t key) {
+      return (key >> shift) & (radix - 1);
+    };
+
+    unsigned parts = detail::num_parts(n, num_threads);
+    std::uint64_t part_size = (n + parts - 1) / parts;
+    std::vector<std::uint64_t> count(parts * radix);
+    utils::parallel_for(parts, 0, n, part_size,
+        [&](unsigned, std::uint64_t lo, std::uint64_t hi) {
+      std::uint64_t* c = &count[lo / part_size * radix];
+      for (std::uint64_t i = lo; i < hi; ++i)
+        c[digit(v[i].first)]++;
+    });
+    std::vector<std::uint64_t> head(radix + 1), tail(radix);
+    for (std::uint64_t d = 0; d < radix; ++d) {
+      std::uint64_t x = 0;
+      for (unsigned part = 0; part < parts; ++part)
+        x += count[part * radix + d];
+      tail[d] = head[d] + x;
+      head[d + 1] = tail[d];
+    }
+    std::vector<std::uint64_t> bucket_start(head.begin(), head.end());
+
+    // American flag sort: move every element straight into its bucket
+    for (std::uint64_t d = 0; d < radix; ++d) {
+      while (head[d] < tail[d]) {
+        KeyValue x = v[head[d]];
+        std::uint64_t dx = digit(x.first);
+        while (dx != d) {
+          std::swap(x, v[head[dx]++]);
+          dx = digit(x.first);
+        }
+        v[head[d]++] = x;
+      }
+    }
+
+    std::vector<std::uint64_t> bucket_size(radix);
+    utils::parallel_for(num_threads, 0, radix, 1,
+        [&](unsigned, std::uint64_t d, std::uint64_t) {
+      auto lo = v.begin() + bucket_start[d], hi = v.begin() + bucket_start[d + 1];
+      std::sort(lo, hi);
+      bucket_size[d] = std::unique(lo, hi,
+          [](const KeyValue& a, const KeyValue& b) { return a.first == b.first; }) - lo;
+    });
+    std::uint64_t total = 0;
+    for (std::uint64_t d = 0; d < radix; ++d) {
+      auto lo = v.begin() + bucket_start[d];
+      std::move(lo, lo + bucket_size[d], v.begin() + total);
+      total += bucket_size[d];
+    }
+    v.resize(total);
+  }
+}
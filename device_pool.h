@@ -0,0 +1,229 @@
+#pragma once
+
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hash.h"
+#include "opencl.h"
+#include "rainbow_cpu.h"
+#include "rainbow_gpu.h"
+#include "rainbow_table.h"
+#include "run_merge.h"
+#include "utils.h"
+
+// Builds and looks up tables on several OpenCL devices at once. Every
+// device has its own OpenCLApp, its own GPUImplementation and a host thread
+// driving it. The devices take rounds of start values and batches of
+// queries from a shared utils::WorkQueue as they finish the previous ones,
+// so every device gets work in proportion to its throughput, which is what
+// makes boxes with mixed devices, including CPU runtimes, use all of them.
+// The native CPU implementation can join the build the same way, see
+// host_threads.
+class DevicePool {
+  struct Device {
+    utils::Stats stats;
+    std::unique_ptr<CPUImplementation> cpu;
+    std::unique_ptr<GPUImplementation> gpu;
+  };
+
+  RainbowTableParams p;
+  CPUImplementation& cpu;
+  utils::Stats& stats;
+  bool verify;
+  OpenCLConfig clcfg;
+  std::vector<std::unique_ptr<Device>> devices;
+
+  // Runs f(device, index) for every device on a thread of its own. An
+  // exception on any of them is rethrown here once all threads are done,
+  // so that cl::Error reaches the caller as with a single device.
+  template <typename F>
+  void run_all(F f) {
+    std::vector<std::exception_ptr> errors(devices.size());
+    auto guarded = [&](std::size_t i) {
+      try {
+        f(*devices[i], i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    };
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < devices.size(); ++i)
+      threads.emplace_back(guarded, i);
+    guarded(0);
+    for (auto& t : threads)
+      t.join();
+    for (auto& error : errors)
+      if (error)
+        std::rethrow_exception(error);
+  }
+
+  // adds the statistics of one engine under the given prefix and reports
+  // how much of the work it did
+  void collect_stats(const std::string& name, utils::Stats& engine_stats,
+      const std::string& work_stat, std::uint64_t total)
+  {
+    auto& engine = engine_stats.stats;
+    if (total)
+      std::cout << "  " << name << ": " << std::setprecision(1)
+        << std::fixed << 100. * engine[work_stat] / total
+        << "% of the work" << std::endl;
+    for (auto& it : engine)
+      stats.add(name + "_" + it.first, it.second);
+    engine.clear();
+  }
+
+  void collect_stats(const std::string& work_stat, std::uint64_t total) {
+    for (std::size_t i = 0; i < devices.size(); ++i)
+      collect_stats("device" + std::to_string(i), devices[i]->stats,
+          work_stat, total);
+  }
+
+public:
+  // runs of all devices after an out-of-core build, see
+  // GPUImplementation::run_size
+  std::vector<std::string> runs;
+  // if non-zero, build() also generates chains on this many CPU threads,
+  // which take chunks of start values from the same queue as the devices
+  unsigned host_threads = 0;
+
+  DevicePool(
+      const RainbowTableParams& p,
+      const std::vector<std::unique_ptr<OpenCLApp>>& apps,
+      CPUImplementation& cpu,
+      utils::Stats& stats,
+      bool verify,
+      const OpenCLConfig& clcfg,
+      uint64_t block_size)
+    : p(p), cpu(cpu), stats(stats), verify(verify), clcfg(clcfg)
+  {
+    assert(!apps.empty());
+    for (auto& app : apps) {
+      devices.emplace_back(new Device);
+      Device& d = *devices.back();
+      d.cpu.reset(new CPUImplementation(p, d.stats, cpu.num_threads));
+      d.gpu.reset(new GPUImplementation(
+            p, *app, *d.cpu, d.stats, verify, this->clcfg, block_size));
+      d.gpu->quiet = devices.size() > 1;
+    }
+  }
+
+  // An OpenCLApp for every device of every platform
+  static std::vector<std::unique_ptr<OpenCLApp>> open_all() {
+    std::vector<std::unique_ptr<OpenCLApp>> apps;
+    for (auto& device : OpenCLApp::all_devices()) {
+      apps.emplace_back(new OpenCLApp(device));
+      apps.back()->print_cl_info();
+    }
+    return apps;
+  }
+
+  std::size_t size() const {
+    return devices.size();
+  }
+
+  // Sets options on the GPUImplementation of every device
+  template <typename F>
+  void configure(F f) {
+    for (std::size_t i = 0; i < devices.size(); ++i)
+      f(*devices[i]->gpu, i);
+  }
+
+  void build(RainbowTable& rt) {
+    std::uint64_t lo = p.table_index * p.num_start_values;
+    utils::WorkQueue work(lo, lo + p.num_start_values);
+    std::vector<std::unique_ptr<RainbowTable>> parts;
+    for (std::size_t i = 0; i < devices.size(); ++i)
+      parts.emplace_back(new RainbowTable);
+    RainbowTable host_part;
+    utils::Stats host_stats;
+    CPUImplementation host(p, host_stats, std::max(1u, host_threads));
+    host.inplace_sort = cpu.inplace_sort;
+    std::cout << "Building on " << devices.size() << " devices";
+    if (host_threads)
+      std::cout << " and " << host_threads << " CPU threads";
+    std::cout << std::endl;
+    stats.add_timing("time_generate", [&]() {
+      std::exception_ptr host_error;
+      std::thread host_thread;
+      if (host_threads)
+        host_thread = std::thread([&]() {
+          try {
+            host.build(work, host_part);
+          } catch (...) {
+            host_error = std::current_exception();
+          }
+        });
+      // the host thread must be joined even if a device fails
+      try {
+        run_all([&](Device& d, std::size_t i) {
+          d.gpu->build(work, *parts[i]);
+        });
+      } catch (...) {
+        if (host_threads)
+          host_thread.join();
+        throw;
+      }
+      if (host_threads)
+        host_thread.join();
+      if (host_error)
+        std::rethrow_exception(host_error);
+    });
+    collect_stats("chains_generated", p.num_start_values);
+    if (host_threads)
+      collect_stats("host", host_stats, "chains_generated",
+          p.num_start_values);
+
+    runs.clear();
+    for (auto& d : devices)
+      runs.insert(runs.end(), d->gpu->runs.begin(), d->gpu->runs.end());
+    if (!runs.empty()) {
+      // the host keeps its chains in memory, they become one more run
+      if (host_part.size()) {
+        runs.push_back(devices[0]->gpu->run_prefix + ".host");
+        host_part.save_to_disk(runs.back());
+      }
+      return;
+    }
+    // every engine keeps the smallest start of its endpoints, and so does
+    // the merge, which makes the table the same as that of a single device
+    stats.add_timing("time_merge", [&]() {
+      std::vector<const RainbowTable*> tables;
+      for (auto& part : parts)
+        tables.push_back(part.get());
+      tables.push_back(&host_part);
+      cpu_primitives::merge_unique_tables(tables, rt.table, cpu.num_threads);
+    });
+  }
+
+  std::vector<std::uint64_t> lookup(
+      const RainbowTable& rt,
+      const std::vector<Hash>& queries,
+      const std::string& name = "")
+  {
+    std::vector<std::uint64_t> res(queries.size(), NOT_FOUND);
+    if (queries.empty())
+      return res;
+    utils::WorkQueue work(0, queries.size());
+    stats.add_timing("time_lookup_devices", [&]() {
+      run_all([&](Device& d, std::size_t) {
+        d.gpu->lookup(rt, queries, work, res, name);
+      });
+    });
+    collect_stats("queries_looked_up", queries.size());
+
+    if (verify) {
+      stats.add_timing("time_verify", [&]() {
+        for (std::uint64_t i = 0; i < queries.size(); ++i) {
+          std::uint64_t cmp = cpu.lookup_single(rt, queries[i]);
+          assert(cmp == res[i]);
+        }
+      });
+    }
+    return res;
+  }
+};
@@ -1,10 +1,13 @@
 #line 2 "filter.cl"
+// IDX is the index type, base the global id of the first work item of the
+// launch (see OpenCLApp::run_kernel_tiled)
 __kernel void set_flags(
     const __global T* ary,
-    __global uint* flags,
-    uint N)
+    __global IDX* flags,
+    ulong N,
+    ulong base)
 {
-  uint i = get_global_id(0);
+  IDX i = base + get_global_id(0);
   if (i > N)
     return;
   flags[i] = i < N ? predicate(ary, i) : 0;
@@ -13,13 +16,14 @@ __kernel void set_flags(
 __kernel void compact(
     const __global T* in,
     __global T* out,
-    __global uint* flags,
-    uint N)
+    __global IDX* flags,
+    ulong N,
+    ulong base)
 {
-  uint i = get_global_id(0);
+  IDX i = base + get_global_id(0);
   if (i >= N)
     return;
-  uint bit = flags[i+1] - flags[i];
+  IDX bit = flags[i+1] - flags[i];
   if (bit)
     out[flags[i]] = in[i];
 }
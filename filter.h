@@ -8,7 +8,7 @@
 #include "utils.h"
 #include "opencl.h"
 #include "scan.h"
-#include "bitonic_sort.h"
+#include "radix_sort.h"
 
 namespace ocl_code {
 #include "filter.cl.h"
@@ -16,90 +16,94 @@ namespace ocl_code {
 }
 
 namespace ocl_primitives {
-  std::tuple<cl::Buffer, uint32_t> filter(
+  // Keeps the elements i of buf for which predicate holds, in order.
+  // predicate is an expression of ary and the index i.
+  std::tuple<cl::Buffer, uint64_t> filter(
       OpenCLApp& cl,
       const OpenCLConfig& clcfg,
-      cl::Buffer buf, uint32_t element_size, uint32_t size,
+      cl::Buffer buf, uint32_t element_size, uint64_t size,
       const std::string& type, const std::string& predicate,
       const std::string& additional_defines = "")
   {
     double t0 = utils::get_time();
-    static std::map<std::tuple<std::string, std::string>,
-      std::tuple<cl::Kernel, cl::Kernel>> memo;
-    auto it = memo.find(std::tie(type, predicate));
-    cl::Kernel kernel_set_flags, kernel_compact;
-    if (it == std::end(memo)) {
-      auto defines = std::string()
-        + "#define T " + type + "\n"
-        + additional_defines + "\n"
-        + "bool predicate(const __global T* ary, uint i);\n"
-        + "bool predicate(const __global T* ary, uint i) { return (" + predicate + "); }\n";
-      auto prog = cl.build_program(std::vector<std::string> {
-        defines,
-        ocl_code::filter_cl_str
-      });
-      kernel_set_flags = cl.get_kernel(prog, "set_flags");
-      kernel_compact = cl.get_kernel(prog, "compact");
-      memo[std::tie(type, predicate)] = std::tie(kernel_set_flags, kernel_compact);
-    } else {
-      std::tie(kernel_set_flags, kernel_compact) = it->second;
-    }
-    cl::Buffer flags = cl.alloc<uint32_t>(size + 1);
+    // the flags are scanned, so they need to count up to size
+    std::string idx = OpenCLApp::index_type(size + 1);
+    auto defines = std::string()
+      + "#define T " + type + "\n"
+      + "#define IDX " + idx + "\n"
+      + additional_defines + "\n"
+      + "bool predicate(const __global T* ary, IDX i);\n"
+      + "bool predicate(const __global T* ary, IDX i) { return (" + predicate + "); }\n";
+    auto prog = cl.build_program(std::vector<std::string> {
+      defines,
+      ocl_code::filter_cl_str
+    });
+    cl::Kernel kernel_set_flags = cl.get_kernel(prog, "set_flags");
+    cl::Kernel kernel_compact = cl.get_kernel(prog, "compact");
+    bool wide = idx == "ulong";
+    uint32_t flag_size = wide ? sizeof(cl_ulong) : sizeof(cl_uint);
+    cl::Buffer flags = cl.alloc<char>(flag_size * (size + 1));
     kernel_set_flags.setArg(0, buf);
     kernel_set_flags.setArg(1, flags);
-    kernel_set_flags.setArg(2, size);
-    cl.run_kernel(kernel_set_flags,
-        cl::NDRange(utils::round_to_multiple(size + 1, clcfg.local_size)),
-        cl::NDRange(clcfg.local_size));
-    scan_naive(cl, clcfg, flags, sizeof(uint32_t), size + 1,
-      "uint", "x + y", "0");
-    uint32_t total;
-    cl.read_sync<uint32_t>(flags, &total, 1, size);
+    kernel_set_flags.setArg(2, (cl_ulong)size);
+    cl.run_kernel_tiled(kernel_set_flags, 3, size + 1, clcfg.local_size);
+    scan(cl, clcfg, flags, flag_size, size + 1, idx, "x + y", "0");
+    uint64_t total;
+    if (wide) {
+      cl_ulong x;
+      cl.read_sync<cl_ulong>(flags, &x, 1, size);
+      total = x;
+    } else {
+      cl_uint x;
+      cl.read_sync<cl_uint>(flags, &x, 1, size);
+      total = x;
+    }
     cl::Buffer res = cl.alloc<char>(element_size * total);
     kernel_compact.setArg(0, buf);
     kernel_compact.setArg(1, res);
     kernel_compact.setArg(2, flags);
-    kernel_compact.setArg(3, size);
-    cl.run_kernel(kernel_compact,
-        cl::NDRange(utils::round_to_multiple(size, clcfg.local_size)),
-        cl::NDRange(clcfg.local_size));
+    kernel_compact.setArg(3, (cl_ulong)size);
+    cl.run_kernel_tiled(kernel_compact, 4, size, clcfg.local_size);
     return std::tie(res, total);
   }
 
-  uint32_t filter_inplace(
+  uint64_t filter_inplace(
       OpenCLApp& cl,
       const OpenCLConfig& clcfg,
-      cl::Buffer buf, uint32_t element_size, uint32_t size,
+      cl::Buffer buf, uint32_t element_size, uint64_t size,
       const std::string& type, const std::string& predicate)
   {
     cl::Buffer res;
-    uint32_t total;
+    uint64_t total;
     std::tie(res, total) = filter(cl, clcfg, buf, element_size, size, type, predicate);
     cl.copy<char>(res, buf, total * element_size);
     return total;
   }
 
-  std::tuple<cl::Buffer, uint32_t> remove_dups(
+  // Sorts buf by key (see radix_sort) and keeps the first element of
+  // every run with the same key, which is the first in the original order.
+  std::tuple<cl::Buffer, uint64_t> remove_dups(
     OpenCLApp& cl,
     const OpenCLConfig& clcfg,
-    cl::Buffer buf, uint32_t element_size, uint32_t size,
-    const std::string& type, const std::string& less)
+    cl::Buffer buf, uint32_t element_size, uint64_t size, int bits,
+    const std::string& type, const std::string& key)
   {
-    bitonic_sort(cl, clcfg, buf, size, type, less);
+    radix_sort(cl, clcfg, buf, element_size, size, bits, type, key);
     return filter(cl, clcfg, buf, element_size, size, type,
-        "i == 0 || less(ary[i-1], ary[i])",
-        "bool less(T x, T y); bool less(T x, T y) { return (" + less + "); }\n");
+        "i == 0 || key(ary[i-1]) != key(ary[i])",
+        "ulong key(T x); ulong key(T x) { return (" + key + "); }\n");
   }
 
-  uint32_t remove_dups_inplace(
+  uint64_t remove_dups_inplace(
     OpenCLApp& cl,
     const OpenCLConfig& clcfg,
-    cl::Buffer buf, uint32_t element_size, uint32_t size,
-    const std::string& type, const std::string& less)
+    cl::Buffer buf, uint32_t element_size, uint64_t size, int bits,
+    const std::string& type, const std::string& key)
   {
     cl::Buffer res;
-    uint32_t total;
-    std::tie(res, total) = remove_dups(cl, clcfg, buf, element_size, size, type, less);
+    uint64_t total;
+    std::tie(res, total) = remove_dups(
+        cl, clcfg, buf, element_size, size, bits, type, key);
     cl.copy<char>(res, buf, total * element_size);
     return total;
   }
@@ -165,7 +169,7 @@ namespace ocl_primitives {
       double t1 = utils::get_time();
 
       // GPU
-      uint32_t total = remove_dups_inplace(cl, clcfg, buf, sizeof(uint32_t), N, "uint", "x < y");
+      uint32_t total = remove_dups_inplace(cl, clcfg, buf, sizeof(uint32_t), N, 10, "uint", "x");
       cl.finish_queue();
       double t2 = utils::get_time();
       std::cout << (t1-t0) << " " <<(t2-t1) << std::endl;
@@ -16,36 +16,39 @@ ulong construct_chain_from_value(
     int end_iteration,
     uint* hash
 );
+ulong rt_lower_bound(
+    const __global ulong2 *rt, ulong lo, ulong hi, ulong endpoint
+);
 ulong rt_lookup(
     const __global ulong2 *rt, ulong lo, ulong hi, ulong endpoint
 );
 
+// offset of the first string of every length, plus a sentinel
+__constant ulong len_offset[] = { LEN_OFFSETS };
+
 int build_string(__constant uint* alphabet, ulong n, uint* buf)
 {
-  ulong offset = 0;
-  ulong num = 1;
   int len = 0;
-  while (offset + num <= n) {
-    offset += num;
-    num *= ALPHA_SIZE;
+  while (len_offset[len + 1] <= n)
     len++;
-  }
-  n -= offset;
-  /*int len = 0;*/
-  /*if (n) {*/
-    /*len = ceil(log((float)n) / log((float)ALPHA_SIZE));*/
-    /*n -= pow((float)ALPHA_SIZE, len - 1);*/
-  /*}*/
+  n -= len_offset[len];
+  // two characters per 64-bit division, the rest are 32-bit divisions by
+  // constants
   uint x = 0;
   int i;
-  for (i = 0; i < len; ++i) {
-    x|=GETCHAR(alphabet, n % ALPHA_SIZE)<<((i&3)<<3);
-    if ((i&3)==3) {
+  for (i = 0; i + 1 < len; i += 2) {
+    uint d = n % (ALPHA_SIZE * ALPHA_SIZE);
+    n /= ALPHA_SIZE * ALPHA_SIZE;
+    x |= (GETCHAR(alphabet, d % ALPHA_SIZE)
+        | GETCHAR(alphabet, d / ALPHA_SIZE) << 8) << ((i&3)<<3);
+    if ((i&3)==2) {
       buf[i>>2] = x;
       x = 0;
     }
-    /*PUTCHAR(buf, i, GETCHAR(alphabet, n % ALPHA_SIZE));*/
-    n /= ALPHA_SIZE;
+  }
+  if (i < len) {
+    x |= GETCHAR(alphabet, (uint)n) << ((i&3)<<3);
+    i++;
   }
   buf[i>>2] = x;
   return len;
@@ -53,7 +56,7 @@ int build_string(__constant uint* alphabet, ulong n, uint* buf)
 
 void hash_from_index(__constant uint* alphabet, ulong idx, uint* hash) {
   uint buf[16];
-  for (int i = 0; i < 16; ++i)
+  for (int i = 0; i < STRING_WORDS; ++i)
     buf[i] = 0;
   int len = build_string(alphabet, idx, buf);
   compute_hash(buf, len, hash);
@@ -62,7 +65,11 @@ void hash_from_index(__constant uint* alphabet, ulong idx, uint* hash) {
 ulong reduce(const uint* hash, ulong round) {
   ulong x = hash[0] | ((ulong)hash[1]<<32);
   x ^= round | (TABLE_INDEX<<32);
+#if REDUCTION == REDUCE_FASTRANGE
+  return mul_hi(x * REDUCE_MIX, (ulong)NUM_STRINGS);
+#else
   return x % NUM_STRINGS;
+#endif
 }
 
 ulong construct_chain_from_hash(
@@ -132,13 +139,18 @@ __kernel void generate_chains(
   }
 }
 
+// A candidate is the endpoint of a query's chain from some position on,
+// together with the position in the high POS_BITS bits and the index of the
+// query in the rest of the second word.
+#define CANDIDATE_QUERY_MASK ((1UL << (64 - POS_BITS)) - 1)
+
 __kernel void compute_endpoints(
     ulong offset,
     ulong hi,
     __constant uint* alphabet,
     const __global uint *queries,
     int num_queries,
-    __global ulong4 *out
+    __global ulong2 *out
     /*,__global ulong *dbg*/
     )
 {
@@ -153,14 +165,14 @@ __kernel void compute_endpoints(
     hash[i] = queries[query_idx * HASH_SIZE + i];
   ulong end = construct_chain_from_hash(
       alphabet, hash, start_iteration, CHAIN_LEN);
-  // TODO  waste less space
-  out[id] = (ulong4){end, start_iteration, query_idx, 0};
+  out[id] = (ulong2){end,
+    (ulong)start_iteration << (64 - POS_BITS) | (ulong)query_idx};
 }
 
 #define NOT_FOUND (ulong)(-1)
 
-ulong rt_lookup(const __global ulong2 *rt, ulong lo, ulong hi_, ulong endpoint) {
-  ulong hi = hi_;
+// first index in [lo, hi) with an endpoint >= endpoint, or hi
+ulong rt_lower_bound(const __global ulong2 *rt, ulong lo, ulong hi, ulong endpoint) {
   while (lo < hi) {
     ulong mid = (lo + hi) / 2;
     if (rt[mid].x >= endpoint)
@@ -168,7 +180,12 @@ ulong rt_lookup(const __global ulong2 *rt, ulong lo, ulong hi_, ulong endpoint)
     else
       lo = mid + 1;
   }
-  return (lo < hi_ && rt[lo].x == endpoint) ? rt[lo].y : NOT_FOUND;
+  return lo;
+}
+
+ulong rt_lookup(const __global ulong2 *rt, ulong lo, ulong hi, ulong endpoint) {
+  lo = rt_lower_bound(rt, lo, hi, endpoint);
+  return (lo < hi && rt[lo].x == endpoint) ? rt[lo].y : NOT_FOUND;
 }
 
 __kernel void fill_ulong(
@@ -183,28 +200,76 @@ __kernel void fill_ulong(
     buf[idx] = a + b * idx;
 }
 
+// A work group whose candidates map to at most JOIN_SPAN * LOCAL_SIZE table
+// entries streams those entries through local memory instead of searching
+// the table in global memory once per candidate.
+#define JOIN_SPAN 16
+
+// Joins the candidates, sorted by endpoint, against the table. Every work
+// group takes LOCAL_SIZE consecutive candidates and first locates the table
+// segment between their smallest and largest endpoint, like the partition
+// step of a merge path. Dense segments are then loaded in coalesced chunks
+// and every candidate is matched against the chunk in local memory. Sparse
+// ones are searched per candidate, but only within the segment.
 __kernel void lookup_endpoints(
     ulong offset,
     ulong hi,
     __constant uint* alphabet,
     const __global uint *queries,
-    const __global ulong4 *lookup,
+    const __global ulong2 *lookup,
     __global ulong *results,
     const __global ulong2 *rt,
     ulong rt_lo, ulong rt_hi
     //,__global ulong *dbg
     )
 {
+  __local ulong2 segment[LOCAL_SIZE];
+  __local ulong bounds[2];
   ulong id = offset + get_global_id(0);
+  uint lid = get_local_id(0);
+  ulong first = offset + get_group_id(0) * LOCAL_SIZE;
+  ulong last = min(hi, first + LOCAL_SIZE) - 1;
+  // endpoints are below NUM_STRINGS, so endpoint + 1 can't overflow
+  if (lid < 2)
+    bounds[lid] = rt_lower_bound(rt, rt_lo, rt_hi,
+        lid ? lookup[last].x + 1 : lookup[first].x);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  ulong seg_lo = bounds[0], seg_hi = bounds[1];
+
+  ulong endpoint = id < hi ? lookup[id].x : 0;
+  ulong start = NOT_FOUND;
+  if (seg_hi - seg_lo > JOIN_SPAN * LOCAL_SIZE) {
+    if (id < hi)
+      start = rt_lookup(rt, seg_lo, seg_hi, endpoint);
+  } else {
+    // the bound is the same for the whole group, so all work items reach
+    // the barriers
+    for (ulong base = seg_lo; base < seg_hi; base += LOCAL_SIZE) {
+      uint n = min((ulong)LOCAL_SIZE, seg_hi - base);
+      if (lid < n)
+        segment[lid] = rt[base + lid];
+      barrier(CLK_LOCAL_MEM_FENCE);
+      if (id < hi && segment[0].x <= endpoint && endpoint <= segment[n - 1].x) {
+        uint a = 0, b = n;
+        while (a < b) {
+          uint mid = (a + b) / 2;
+          if (segment[mid].x >= endpoint)
+            b = mid;
+          else
+            a = mid + 1;
+        }
+        if (segment[a].x == endpoint)
+          start = segment[a].y;
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+  }
   if (id >= hi)
     return;
-
-  ulong endpoint = lookup[id].x;
-  int start_iteration = lookup[id].y;
-  int query_idx = lookup[id].z;
+  int start_iteration = lookup[id].y >> (64 - POS_BITS);
+  int query_idx = lookup[id].y & CANDIDATE_QUERY_MASK;
 
   // we assume perfect rainbow table here!
-  ulong start = rt_lookup(rt, rt_lo, rt_hi, endpoint);
   if (start != NOT_FOUND) {
     uint hash[HASH_SIZE];
     ulong candidate = construct_chain_from_value(
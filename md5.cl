@@ -4,6 +4,10 @@
 uint4 md5_compress(uint *buf, uint4 state);
 void md5(uint *buf, uint len, uint* hash);
 
+#ifndef STRING_WORDS
+#define STRING_WORDS 14
+#endif
+
 /* Macros for reading/writing chars from int32's (from rar_kernel.cl) */
 #define GETCHAR(buf, index) ((((buf)[((index)>>2)] >> (((index) & 3)<<3)))&0xff)
 #define PUTCHAR(buf, index, val) (buf)[(index)>>2] = ((buf)[(index)>>2] & ~(0xffU << (((index) & 3) << 3))) + ((val) << (((index) & 3) << 3))
@@ -21,7 +25,10 @@ uint4 md5_compress(uint *buf, uint4 state) {
       (a) = (((a) << (s)) | ((a) >> (32 - (s)))); \
       (a) += (b);
 
-  #define GET(i) (buf[(i)])
+  /* Only the first STRING_WORDS words and the length in word 14 can be
+   * non-zero for our plaintexts. All other words are constant zero, which
+   * the compiler folds into the round constants. */
+  #define GET(i) ((i) < STRING_WORDS || (i) == 14 ? buf[(i)] : 0)
 
   uint a, b, c, d;
   a = state.x;
@@ -115,7 +122,8 @@ uint4 md5_compress(uint *buf, uint4 state) {
 #undef I
 }
 
-// 1 block only. len must be <= 55. buf must be zero after len
+// 1 block only. len must be <= 55 and < 4 * STRING_WORDS. buf must be zero
+// after len
 void md5(uint *buf, uint len, uint* hash) {
   PUTCHAR(buf, len, 0x80);
 
@@ -21,6 +21,7 @@
  *   out of or in connection with the Software or the use or other dealings in the
  *   Software.
  */
+#include <cassert>
 #include <cstdint>
 #include <cstring>
 #include "md5.h"
@@ -139,3 +140,183 @@ void md5_hash(const uint8_t *message, uint32_t len, uint32_t hash[4]) {
   block[15] = len >> 29;
   md5_compress(hash, block);
 }
+
+/*
+ * Multi-buffer MD5: hash several independent single-block messages at once,
+ * one message per SIMD lane. The round structure is the same as in
+ * md5_compress above, only on GCC vector types.
+ */
+#define MD5_LANES_BODY(V, lanes)                                      \
+  V blk[16], st[4];                                                   \
+  for (int i = 0; i < 16; ++i)                                        \
+    memcpy(&blk[i], block + i * lanes, sizeof(V));                    \
+  V a = st[0] = (V){} + UINT32_C(0x67452301);                         \
+  V b = st[1] = (V){} + UINT32_C(0xEFCDAB89);                         \
+  V c = st[2] = (V){} + UINT32_C(0x98BADCFE);                         \
+  V d = st[3] = (V){} + UINT32_C(0x10325476);                         \
+  MD5_ROUNDS                                                          \
+  a += st[0]; b += st[1]; c += st[2]; d += st[3];                     \
+  memcpy(hash + 0 * lanes, &a, sizeof(V));                            \
+  memcpy(hash + 1 * lanes, &b, sizeof(V));                            \
+  memcpy(hash + 2 * lanes, &c, sizeof(V));                            \
+  memcpy(hash + 3 * lanes, &d, sizeof(V));
+
+#define MD5_ROUNDS                                                    \
+  ROUND0(a, b, c, d,  0,  7, 0xD76AA478)                              \
+  ROUND0(d, a, b, c,  1, 12, 0xE8C7B756)                              \
+  ROUND0(c, d, a, b,  2, 17, 0x242070DB)                              \
+  ROUND0(b, c, d, a,  3, 22, 0xC1BDCEEE)                              \
+  ROUND0(a, b, c, d,  4,  7, 0xF57C0FAF)                              \
+  ROUND0(d, a, b, c,  5, 12, 0x4787C62A)                              \
+  ROUND0(c, d, a, b,  6, 17, 0xA8304613)                              \
+  ROUND0(b, c, d, a,  7, 22, 0xFD469501)                              \
+  ROUND0(a, b, c, d,  8,  7, 0x698098D8)                              \
+  ROUND0(d, a, b, c,  9, 12, 0x8B44F7AF)                              \
+  ROUND0(c, d, a, b, 10, 17, 0xFFFF5BB1)                              \
+  ROUND0(b, c, d, a, 11, 22, 0x895CD7BE)                              \
+  ROUND0(a, b, c, d, 12,  7, 0x6B901122)                              \
+  ROUND0(d, a, b, c, 13, 12, 0xFD987193)                              \
+  ROUND0(c, d, a, b, 14, 17, 0xA679438E)                              \
+  ROUND0(b, c, d, a, 15, 22, 0x49B40821)                              \
+  ROUND1(a, b, c, d,  1,  5, 0xF61E2562)                              \
+  ROUND1(d, a, b, c,  6,  9, 0xC040B340)                              \
+  ROUND1(c, d, a, b, 11, 14, 0x265E5A51)                              \
+  ROUND1(b, c, d, a,  0, 20, 0xE9B6C7AA)                              \
+  ROUND1(a, b, c, d,  5,  5, 0xD62F105D)                              \
+  ROUND1(d, a, b, c, 10,  9, 0x02441453)                              \
+  ROUND1(c, d, a, b, 15, 14, 0xD8A1E681)                              \
+  ROUND1(b, c, d, a,  4, 20, 0xE7D3FBC8)                              \
+  ROUND1(a, b, c, d,  9,  5, 0x21E1CDE6)                              \
+  ROUND1(d, a, b, c, 14,  9, 0xC33707D6)                              \
+  ROUND1(c, d, a, b,  3, 14, 0xF4D50D87)                              \
+  ROUND1(b, c, d, a,  8, 20, 0x455A14ED)                              \
+  ROUND1(a, b, c, d, 13,  5, 0xA9E3E905)                              \
+  ROUND1(d, a, b, c,  2,  9, 0xFCEFA3F8)                              \
+  ROUND1(c, d, a, b,  7, 14, 0x676F02D9)                              \
+  ROUND1(b, c, d, a, 12, 20, 0x8D2A4C8A)                              \
+  ROUND2(a, b, c, d,  5,  4, 0xFFFA3942)                              \
+  ROUND2(d, a, b, c,  8, 11, 0x8771F681)                              \
+  ROUND2(c, d, a, b, 11, 16, 0x6D9D6122)                              \
+  ROUND2(b, c, d, a, 14, 23, 0xFDE5380C)                              \
+  ROUND2(a, b, c, d,  1,  4, 0xA4BEEA44)                              \
+  ROUND2(d, a, b, c,  4, 11, 0x4BDECFA9)                              \
+  ROUND2(c, d, a, b,  7, 16, 0xF6BB4B60)                              \
+  ROUND2(b, c, d, a, 10, 23, 0xBEBFBC70)                              \
+  ROUND2(a, b, c, d, 13,  4, 0x289B7EC6)                              \
+  ROUND2(d, a, b, c,  0, 11, 0xEAA127FA)                              \
+  ROUND2(c, d, a, b,  3, 16, 0xD4EF3085)                              \
+  ROUND2(b, c, d, a,  6, 23, 0x04881D05)                              \
+  ROUND2(a, b, c, d,  9,  4, 0xD9D4D039)                              \
+  ROUND2(d, a, b, c, 12, 11, 0xE6DB99E5)                              \
+  ROUND2(c, d, a, b, 15, 16, 0x1FA27CF8)                              \
+  ROUND2(b, c, d, a,  2, 23, 0xC4AC5665)                              \
+  ROUND3(a, b, c, d,  0,  6, 0xF4292244)                              \
+  ROUND3(d, a, b, c,  7, 10, 0x432AFF97)                              \
+  ROUND3(c, d, a, b, 14, 15, 0xAB9423A7)                              \
+  ROUND3(b, c, d, a,  5, 21, 0xFC93A039)                              \
+  ROUND3(a, b, c, d, 12,  6, 0x655B59C3)                              \
+  ROUND3(d, a, b, c,  3, 10, 0x8F0CCC92)                              \
+  ROUND3(c, d, a, b, 10, 15, 0xFFEFF47D)                              \
+  ROUND3(b, c, d, a,  1, 21, 0x85845DD1)                              \
+  ROUND3(a, b, c, d,  8,  6, 0x6FA87E4F)                              \
+  ROUND3(d, a, b, c, 15, 10, 0xFE2CE6E0)                              \
+  ROUND3(c, d, a, b,  6, 15, 0xA3014314)                              \
+  ROUND3(b, c, d, a, 13, 21, 0x4E0811A1)                              \
+  ROUND3(a, b, c, d,  4,  6, 0xF7537E82)                              \
+  ROUND3(d, a, b, c, 11, 10, 0xBD3AF235)                              \
+  ROUND3(c, d, a, b,  2, 15, 0x2AD7D2BB)                              \
+  ROUND3(b, c, d, a,  9, 21, 0xEB86D391)
+
+#undef ROUND_TAIL
+#define ROUND_TAIL(a, b, expr, k, s, t)    \
+  a += (expr) + UINT32_C(t) + blk[k];      \
+  a = b + (a << s | a >> (32 - s));
+
+typedef uint32_t md5_v4 __attribute__((vector_size(16)));
+typedef uint32_t md5_v8 __attribute__((vector_size(32)));
+typedef uint32_t md5_v16 __attribute__((vector_size(64)));
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define MD5_TARGET(isa) __attribute__((target(isa)))
+#else
+#  define MD5_TARGET(isa)
+#endif
+
+MD5_TARGET("sse2")
+void md5_hash_x4(const uint32_t *block, uint32_t *hash) {
+  MD5_LANES_BODY(md5_v4, 4)
+}
+
+MD5_TARGET("avx2")
+void md5_hash_x8(const uint32_t *block, uint32_t *hash) {
+  MD5_LANES_BODY(md5_v8, 8)
+}
+
+MD5_TARGET("avx512f")
+void md5_hash_x16(const uint32_t *block, uint32_t *hash) {
+  MD5_LANES_BODY(md5_v16, 16)
+}
+
+/*
+ * Single-block MD5 for messages of a fixed length Len <= 55. Everything past
+ * the message is known at compile time (the 0x80 byte, zeroes and the length
+ * in word 14), so those words fold into the round constants.
+ */
+template <uint32_t Len>
+static void md5_hash_short_(const uint32_t *words, uint32_t hash[4]) {
+  static_assert(Len <= 55, "message does not fit into one block");
+  const uint32_t pad_word = Len / 4, pad_shift = Len % 4 * 8;
+  uint32_t blk[16];
+  for (uint32_t k = 0; k < 16; ++k) {
+    if (k < pad_word)
+      blk[k] = words[k];
+    else if (k == pad_word)
+      blk[k] = (pad_shift ? words[k] & ((UINT32_C(1) << pad_shift) - 1) : 0)
+        | UINT32_C(0x80) << pad_shift;
+    else if (k == 14)
+      blk[k] = Len << 3;
+    else
+      blk[k] = 0;
+  }
+  uint32_t a = UINT32_C(0x67452301);
+  uint32_t b = UINT32_C(0xEFCDAB89);
+  uint32_t c = UINT32_C(0x98BADCFE);
+  uint32_t d = UINT32_C(0x10325476);
+  MD5_ROUNDS
+  hash[0] = a + UINT32_C(0x67452301);
+  hash[1] = b + UINT32_C(0xEFCDAB89);
+  hash[2] = c + UINT32_C(0x98BADCFE);
+  hash[3] = d + UINT32_C(0x10325476);
+}
+
+void md5_hash_short(const uint32_t *words, uint32_t len, uint32_t hash[4]) {
+  #define CASE(n) case n: md5_hash_short_<n>(words, hash); return;
+  #define CASE8(n) CASE(n) CASE(n+1) CASE(n+2) CASE(n+3) \
+                   CASE(n+4) CASE(n+5) CASE(n+6) CASE(n+7)
+  switch (len) {
+    CASE8(0) CASE8(8) CASE8(16) CASE8(24) CASE8(32) CASE8(40) CASE8(48)
+  }
+  #undef CASE8
+  #undef CASE
+  md5_hash((const uint8_t *)words, len, hash);
+}
+
+int md5_max_lanes() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return 16;
+  if (__builtin_cpu_supports("avx2"))
+    return 8;
+#endif
+  return 4;
+}
+
+void md5_hash_lanes(int lanes, const uint32_t *block, uint32_t *hash) {
+  switch (lanes) {
+    case 4: md5_hash_x4(block, hash); break;
+    case 8: md5_hash_x8(block, hash); break;
+    case 16: md5_hash_x16(block, hash); break;
+    default: assert(0);
+  }
+}
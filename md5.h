@@ -4,3 +4,19 @@
 
 void md5_compress(uint32_t state[4], const uint32_t block[16]);
 void md5_hash(const uint8_t *message, uint32_t len, uint32_t hash[4]);
+
+// MD5 of a message of at most 55 bytes, which fits into a single block.
+// There is a specialised variant for every length, with the padding folded
+// into the round constants. Bytes of words[] past len are ignored.
+void md5_hash_short(const uint32_t *words, uint32_t len, uint32_t hash[4]);
+
+// Multi-buffer MD5 of 4, 8 or 16 independent, already padded single blocks.
+// The messages are stored interleaved: word i of lane j lives at
+// block[i * lanes + j], and the hash words are laid out the same way.
+void md5_hash_x4(const uint32_t *block, uint32_t *hash);
+void md5_hash_x8(const uint32_t *block, uint32_t *hash);
+void md5_hash_x16(const uint32_t *block, uint32_t *hash);
+
+// Widest lane count the CPU we are running on supports
+int md5_max_lanes();
+void md5_hash_lanes(int lanes, const uint32_t *block, uint32_t *hash);
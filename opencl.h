@@ -1,22 +1,46 @@
 #pragma once
 
+#include <cstdint>
+
+struct OpenCLConfig {
+  uint32_t global_size, local_size;
+};
+
+// Everything below needs the OpenCL headers. The CPU-only programs just
+// include this file for OpenCLConfig.
+#if HAVE_OPENCL
+
 #include <algorithm>
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define __CL_ENABLE_EXCEPTIONS
 #include "cl.hpp"
 
+#include "md5.h"
+
 class OpenCLApp {
   cl::Platform platform;
   cl::Device device;
   cl::Context context;
   cl::CommandQueue queue;
+  // where program binaries are cached across runs, empty if disabled
+  std::string cache_dir;
 
   template<typename T>
   void write(cl::Buffer buf, cl_bool blocking, T* ptr, size_t num, size_t offset=0) {
@@ -27,23 +51,25 @@ class OpenCLApp {
   }
 
   template<typename T>
-  void read(cl::Buffer buf, cl_bool blocking, T* ptr, size_t num, size_t offset=0) {
+  void read(cl::Buffer buf, cl_bool blocking, T* ptr, size_t num, size_t offset=0,
+      cl::Event* done=nullptr) {
     if (num == 0)
       return;
     queue.enqueueReadBuffer(
-        buf, blocking, offset * sizeof(T), num * sizeof(T), ptr, nullptr, nullptr);
+        buf, blocking, offset * sizeof(T), num * sizeof(T), ptr, nullptr, done);
   }
 
   template<typename T>
   void copy_(
       cl::Buffer a, cl::Buffer b,
-      size_t num, size_t offset_a=0, size_t offset_b=0)
+      size_t num, size_t offset_a=0, size_t offset_b=0,
+      const std::vector<cl::Event>* wait=nullptr, cl::Event* done=nullptr)
   {
     if (num == 0)
       return;
     queue.enqueueCopyBuffer(
         a, b, offset_a * sizeof(T), offset_b * sizeof(T),
-        num * sizeof(T), nullptr, nullptr);
+        num * sizeof(T), wait, done);
   }
 
   void print_build_log(cl::Program prog) {
@@ -55,15 +81,103 @@ class OpenCLApp {
       std::cout << "BUILD LOG" << std::endl << build_log.substr(0, top) << std::endl;
   }
 
-  void select_device() {
-    std::vector<cl::Platform> platforms;
-    cl::Platform::get(&platforms);
-    std::vector<cl::Device> devices;
-    for (auto& p : platforms) {
-      std::vector<cl::Device> platform_devs;
-      p.getDevices(CL_DEVICE_TYPE_ALL, &platform_devs);
-      std::copy(begin(platform_devs), end(platform_devs), back_inserter(devices));
+  // The cache key covers everything that influences the binary: the
+  // sources including the #defines prepended to them, and the identity of
+  // the device and the driver compiling them.
+  std::string program_key(const std::vector<std::string>& sources) {
+    std::string data;
+    for (auto info: { CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DRIVER_VERSION,
+                      CL_DEVICE_VERSION })
+    {
+      std::string s;
+      device.getInfo(info, &s);
+      data += s + '\0';
+    }
+    data += platform.getInfo<CL_PLATFORM_VERSION>();
+    for (const auto& s: sources) {
+      data += '\0';
+      data += s;
+    }
+    uint32_t hash[4];
+    md5_hash((const uint8_t*)data.data(), data.size(), hash);
+    std::ostringstream key;
+    for (int i = 0; i < 16; ++i) {
+      key.width(2);
+      key.fill('0');
+      key << std::hex << ((hash[i / 4] >> (i % 4 * 8)) & 0xff);
+    }
+    return key.str();
+  }
+
+  std::string program_binary(const cl::Program& prog) {
+    auto binaries = prog.getInfo<CL_PROGRAM_BINARIES>();
+    auto sizes = prog.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    assert(binaries.size() == 1 && sizes.size() == 1);
+    std::string res(binaries[0], sizes[0]);
+    for (char* binary : binaries)
+      delete[] binary;
+    return res;
+  }
+
+  // Returns false if there is no usable binary for key in the cache
+  bool load_cached_program(const std::string& key, cl::Program& prog) {
+    if (cache_dir.empty())
+      return false;
+    std::ifstream f(cache_dir + "/" + key + ".bin", std::ios::binary);
+    std::string binary((std::istreambuf_iterator<char>(f)),
+        std::istreambuf_iterator<char>());
+    if (binary.empty())
+      return false;
+    std::vector<cl::Device> devices(1, device);
+    cl::Program::Binaries binaries(1,
+        std::make_pair((const void*)binary.data(), binary.size()));
+    // a driver update can make old binaries unusable without changing the
+    // version string, in which case we just compile from scratch
+    try {
+      prog = cl::Program(context, devices, binaries, nullptr, nullptr);
+      prog.build(devices, nullptr, nullptr, nullptr);
+    } catch (cl::Error err) {
+      return false;
     }
+    return true;
+  }
+
+  // Creates dir and any missing parents, like mkdir -p
+  static bool make_dirs(const std::string& dir) {
+    for (std::size_t pos = 1; pos <= dir.size(); ++pos) {
+      if (pos < dir.size() && dir[pos] != '/')
+        continue;
+      std::string prefix = dir.substr(0, pos);
+      if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+    }
+    return true;
+  }
+
+  void store_cached_program(const std::string& key, const cl::Program& prog) {
+    if (cache_dir.empty() || !make_dirs(cache_dir))
+      return;
+    // write and rename, so that concurrent processes never see a partial
+    // binary
+    std::string filename = cache_dir + "/" + key + ".bin";
+    std::string tmp = filename + "." + std::to_string(getpid()) + "."
+      + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+      std::ofstream f(tmp, std::ios::binary);
+      std::string binary = program_binary(prog);
+      f.write(binary.data(), binary.size());
+      if (!f) {
+        f.close();
+        unlink(tmp.c_str());
+        return;
+      }
+    }
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+      unlink(tmp.c_str());
+  }
+
+  void select_device() {
+    std::vector<cl::Device> devices = all_devices();
     assert(!devices.empty());
     device = devices[0];
     for (auto& d : devices) {
@@ -74,16 +188,50 @@ class OpenCLApp {
         break;
       }
     }
+  }
+
+  void init() {
     device.getInfo(CL_DEVICE_PLATFORM, &platform);
+    std::vector<cl::Device> devices;
+    devices.push_back(device);
+    context = cl::Context(devices, nullptr, nullptr, nullptr, nullptr);
+    queue = cl::CommandQueue(context, device, 0, nullptr);
+    // RT_CL_CACHE overrides the cache directory, setting it to the empty
+    // string disables the cache
+    if (const char* dir = getenv("RT_CL_CACHE"))
+      cache_dir = dir;
+    else if (const char* home = getenv("HOME"))
+      cache_dir = std::string(home) + "/.cache/rt-kernels";
   }
 
 public:
+  // uses the first GPU, or the first device if there is no GPU
   OpenCLApp() {
     select_device();
+    init();
+  }
+
+  explicit OpenCLApp(const cl::Device& device) : device(device) {
+    init();
+  }
+
+  // the devices of all platforms, including CPU runtimes
+  static std::vector<cl::Device> all_devices() {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
     std::vector<cl::Device> devices;
-    devices.push_back(device);
-    context = cl::Context(devices, nullptr, nullptr, nullptr, nullptr);
-    queue = cl::CommandQueue(context, device, 0, nullptr);
+    for (auto& p : platforms) {
+      std::vector<cl::Device> platform_devs;
+      p.getDevices(CL_DEVICE_TYPE_ALL, &platform_devs);
+      std::copy(begin(platform_devs), end(platform_devs), back_inserter(devices));
+    }
+    return devices;
+  }
+
+  // Identifies the context. Kernels and buffers can only be used with apps
+  // with the same context, that is, this one and its forks.
+  cl_context context_id() const {
+    return context();
   }
 
   void print_cl_info() {
@@ -115,13 +263,7 @@ public:
   }
 
   std::string get_binary(cl::Program prog) {
-    auto binaries = prog.getInfo<CL_PROGRAM_BINARIES>();
-    std::string res = "";
-    for (char* binary : binaries) {
-      res += std::string(binary);
-      res += "\n\n";
-    }
-    return res;
+    return program_binary(prog) + "\n\n";
   }
 
   template <typename T>
@@ -129,7 +271,32 @@ public:
     return cl::Buffer(context, flags, std::max(size_t{1}, num * sizeof(T)), nullptr, nullptr);
   }
 
+  // Builds a program, or reuses the binary from an earlier build of the
+  // same sources for the same device, in this process or on disk. Programs
+  // built in this process are shared by all apps with the same context,
+  // which may build them on different threads. The cache keeps the
+  // programs, and with them their context, alive, so context ids are never
+  // reused while they are in it.
   cl::Program build_program(const std::vector<std::string>& sources) {
+    static std::map<std::pair<cl_context, std::string>, cl::Program> programs;
+    static std::mutex programs_mutex;
+    auto key = std::make_pair(context_id(), program_key(sources));
+    {
+      std::lock_guard<std::mutex> lock(programs_mutex);
+      auto it = programs.find(key);
+      if (it != programs.end())
+        return it->second;
+    }
+    cl::Program prog;
+    if (!load_cached_program(key.second, prog)) {
+      prog = compile_program(sources);
+      store_cached_program(key.second, prog);
+    }
+    std::lock_guard<std::mutex> lock(programs_mutex);
+    return programs.emplace(key, prog).first->second;
+  }
+
+  cl::Program compile_program(const std::vector<std::string>& sources) {
     std::vector<std::pair<const char*, size_t>> sources_;
     for (const auto& s: sources)
       sources_.emplace_back(s.c_str(), s.size());
@@ -169,6 +336,13 @@ public:
     read(buf, false, ptr, num, offset);
   }
 
+  // Like read_async, but signals done once ptr holds the data
+  template<typename T>
+  void read_after(const cl::Buffer& buf, T* ptr, size_t num, cl::Event& done) {
+    assert(num > 0);
+    read(buf, false, ptr, num, 0, &done);
+  }
+
   template<typename T>
   void read_sync(const cl::Buffer& buf, T* ptr, size_t num, size_t offset=0) {
     read(buf, true, ptr, num, offset);
@@ -182,16 +356,75 @@ public:
     copy_<T>(a, b, num, offset_a, offset_b);
   }
 
+  // Like copy, but only starts after all of wait completed, and signals
+  // done when finished. Use this to order work across queues.
+  template<typename T>
+  void copy_after(
+      const cl::Buffer& a, const cl::Buffer& b,
+      size_t num, size_t offset_a, size_t offset_b,
+      const std::vector<cl::Event>& wait, cl::Event& done)
+  {
+    assert(num > 0);
+    copy_<T>(a, b, num, offset_a, offset_b, &wait, &done);
+  }
+
   void finish_queue() {
     queue.finish();
   }
 
-  void run_kernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local) {
+  // Submits everything enqueued so far to the device without waiting
+  void flush_queue() {
+    queue.flush();
+  }
+
+  cl_ulong global_mem_size() const {
+    return device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+  }
+
+  // largest single buffer the device supports
+  cl_ulong max_alloc_size() const {
+    return device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+  }
+
+  // Returns an app for the same device and context, but with a queue of
+  // its own, so that work submitted to it can overlap with work on ours.
+  // Buffers and events can be shared between the two.
+  OpenCLApp fork_queue() const {
+    OpenCLApp res(*this);
+    res.queue = cl::CommandQueue(context, device, 0, nullptr);
+    return res;
+  }
+
+  void run_kernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local,
+      const std::vector<cl::Event>* wait=nullptr, cl::Event* done=nullptr) {
     assert(global[0] % local[0] == 0);
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, nullptr);
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, wait, done);
   }
-};
 
-struct OpenCLConfig {
-  uint32_t global_size, local_size;
+  // largest global size run_kernel_tiled uses for a single launch
+  static const uint64_t MAX_LAUNCH = uint64_t{1} << 30;
+
+  // Runs kernel on items work items, rounded up to a multiple of local,
+  // in launches of at most MAX_LAUNCH work items, because some devices
+  // limit the global size. Argument base_arg is set to the global id of
+  // the first work item of every launch, as a ulong.
+  void run_kernel_tiled(cl::Kernel& kernel, cl_uint base_arg,
+      uint64_t items, uint64_t local) {
+    uint64_t total = (items + local - 1) / local * local;
+    uint64_t step = MAX_LAUNCH / local * local;
+    for (uint64_t base = 0; base < total; base += step) {
+      kernel.setArg(base_arg, (cl_ulong)base);
+      run_kernel(kernel, cl::NDRange(std::min(step, total - base)),
+          cl::NDRange(local));
+    }
+  }
+
+  // OpenCL type for indices into a buffer of size elements. 64-bit integer
+  // arithmetic is slow on most GPUs, so the primitives only use it where
+  // 32 bits could overflow.
+  static std::string index_type(uint64_t size) {
+    return size < (uint64_t{1} << 31) ? "uint" : "ulong";
+  }
 };
+
+#endif
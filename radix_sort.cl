@@ -1,61 +1,108 @@
 #line 2 "radix_sort.cl"
-__kernel void write_bits(
-    const __global T *ary,
-    uint size,
-    int b,
-    __global uint *bits,
-    uint offset
+// LSD radix sort, RADIX_BITS bits per pass. Every work group owns a tile of
+// TILE consecutive elements. A pass first counts the digits of every tile,
+// then the counts are scanned on the device (digit-major, so the scan gives
+// every (digit, tile) pair its first output position), and finally every
+// tile scatters its elements there. Needs T, KEY(x), IDX (the index type),
+// LOCAL_SIZE (a power of two), RADIX_BITS and TILE (a multiple of
+// LOCAL_SIZE). base is the global id of the first work item of the launch
+// (see OpenCLApp::run_kernel_tiled) and groups the number of tiles.
+
+#define RADIX (1 << RADIX_BITS)
+#define DIGIT(x, shift) ((uint)(KEY(x) >> (shift)) & (RADIX - 1))
+
+__kernel void radix_histogram(
+    const __global T *in,
+    ulong size,
+    uint shift,
+    __global IDX *hist,
+    ulong groups,
+    ulong base
 )
 {
-  uint idx = offset + get_global_id(0);
-  bits[idx] = idx < size ? (1-GET_BIT(ary[idx], b)) : 0;
+  __local uint counts[RADIX];
+  uint lid = get_local_id(0);
+  IDX group = base / LOCAL_SIZE + get_group_id(0);
+  for (uint d = lid; d < RADIX; d += LOCAL_SIZE)
+    counts[d] = 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  IDX lo = group * TILE, hi = min((IDX)size, lo + TILE);
+  for (IDX i = lo + lid; i < hi; i += LOCAL_SIZE)
+    atomic_inc(&counts[DIGIT(in[i], shift)]);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (uint d = lid; d < RADIX; d += LOCAL_SIZE)
+    hist[d * groups + group] = counts[d];
+}
+
+// exclusive prefix sum of x over the work group, the sum of all x is
+// stored in total
+uint local_scan(__local uint *tmp, uint x, uint *total) {
+  uint lid = get_local_id(0);
+  tmp[lid] = x;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (uint offset = 1; offset < LOCAL_SIZE; offset <<= 1) {
+    uint y = lid >= offset ? tmp[lid - offset] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    tmp[lid] += y;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  uint res = tmp[lid] - x;
+  *total = tmp[LOCAL_SIZE - 1];
+  barrier(CLK_LOCAL_MEM_FENCE);
+  return res;
 }
 
-__kernel void partition(
+__kernel void radix_scatter(
     const __global T *in,
     __global T *out,
-    uint size,
-    const __global uint *count,
-    uint offset
+    ulong size,
+    uint shift,
+    const __global IDX *offsets,
+    ulong groups,
+    ulong base
 )
 {
-  uint lidx = get_local_id(0), gidx = offset + get_global_id(0);
-  uint lo = gidx - lidx, hi = lo + LOCAL_SIZE;
-  uint total_zeroes = count[size];
-  uint zeroes_start = count[lo];
-  uint zeroes_group = count[hi] - zeroes_start;
-  __local T part_zeroes[LOCAL_SIZE];
-  __local T part_ones[LOCAL_SIZE];
-  int bit = 1 - count[gidx + 1] + count[gidx];
-  uint zeroes_prefix = count[gidx] - zeroes_start;
-  if (gidx < size) {
-    if (bit) {
-      part_ones[lidx - zeroes_prefix] = in[gidx];
-    } else {
-      part_zeroes[zeroes_prefix] = in[gidx];
+  __local T elems[LOCAL_SIZE];
+  __local uint digits[LOCAL_SIZE];
+  __local uint tmp[LOCAL_SIZE];
+  __local IDX next[RADIX];
+  __local uint run_start[RADIX];
+  uint lid = get_local_id(0);
+  IDX group = base / LOCAL_SIZE + get_group_id(0);
+  for (uint d = lid; d < RADIX; d += LOCAL_SIZE)
+    next[d] = offsets[d * groups + group];
+  IDX lo = group * TILE, hi = min((IDX)size, lo + TILE);
+  for (IDX chunk = lo; chunk < hi; chunk += LOCAL_SIZE) {
+    uint n = min((IDX)LOCAL_SIZE, hi - chunk);
+    T x;
+    uint digit = RADIX - 1;
+    if (lid < n) {
+      x = in[chunk + lid];
+      digit = DIGIT(x, shift);
     }
+    // Sort the chunk stably by digit in local memory, one bit at a time.
+    // Padding items have the largest digit and come last, so they stay
+    // behind all real items.
+    for (uint b = 0; b < RADIX_BITS; ++b) {
+      uint bit = (digit >> b) & 1, zeroes;
+      uint zeroes_before = local_scan(tmp, 1 - bit, &zeroes);
+      uint pos = bit ? zeroes + lid - zeroes_before : zeroes_before;
+      elems[pos] = x;
+      digits[pos] = digit;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      x = elems[lid];
+      digit = digits[lid];
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid < n && (lid == 0 || digits[lid - 1] != digit))
+      run_start[digit] = lid;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint rank = lid - run_start[digit];
+    if (lid < n)
+      out[next[digit] + rank] = x;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < n && (lid == n - 1 || digits[lid + 1] != digit))
+      next[digit] += rank + 1;
+    barrier(CLK_LOCAL_MEM_FENCE);
   }
-  barrier(CLK_LOCAL_MEM_FENCE);
-  if (lidx < zeroes_group) {
-    gidx = zeroes_start + lidx;
-    if (gidx < size)
-      out[gidx] = part_zeroes[lidx];
-  } else {
-    lidx -= zeroes_group;
-    gidx = total_zeroes + lo - zeroes_start + lidx;
-    if (gidx < size)
-      out[gidx] = part_ones[lidx];
-  }
-}
-
-__kernel void Scan_Naive(
-    const __global uint* inArray,
-    __global uint* outArray,
-    uint N, uint offset)
-{
-  uint gidx = get_global_id(0);
-  if (gidx < offset)
-    outArray[gidx] = inArray[gidx];
-  else
-    outArray[gidx] = inArray[gidx] + inArray[gidx - offset];
 }
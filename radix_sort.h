@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "opencl.h"
+#include "scan.h"
+
+namespace ocl_code {
+#include "radix_sort.cl.h"
+  std::string radix_sort_cl_str(radix_sort_cl, radix_sort_cl + radix_sort_cl_len);
+}
+
+namespace ocl_primitives {
+  const int RADIX_BITS = 4;
+  // elements per work group and pass, in multiples of the local size
+  const uint32_t RADIX_TILE = 16;
+
+  // Stable sort of buf by the lowest `bits` bits of key, an expression of
+  // the element x that must evaluate to an integer.
+  void radix_sort(
+      OpenCLApp& cl,
+      const OpenCLConfig& clcfg,
+      cl::Buffer buf, uint32_t element_size, uint64_t size, int bits,
+      const std::string& type, const std::string& key)
+  {
+    std::string idx = OpenCLApp::index_type(size);
+    auto defines = std::string()
+      + "#define T " + type + "\n"
+      + "#define IDX " + idx + "\n"
+      + "#define KEY(x) ((ulong)(" + key + "))\n"
+      + "#define LOCAL_SIZE " + std::to_string(clcfg.local_size) + "\n"
+      + "#define RADIX_BITS " + std::to_string(RADIX_BITS) + "\n"
+      + "#define TILE " + std::to_string(RADIX_TILE * clcfg.local_size) + "\n";
+    auto prog = cl.build_program(std::vector<std::string> {
+      defines,
+      ocl_code::radix_sort_cl_str
+    });
+    cl::Kernel kernel_histogram = cl.get_kernel(prog, "radix_histogram");
+    cl::Kernel kernel_scatter = cl.get_kernel(prog, "radix_scatter");
+    if (size < 2 || bits <= 0)
+      return;
+    uint64_t tile = RADIX_TILE * clcfg.local_size;
+    uint64_t groups = (size + tile - 1) / tile;
+    uint64_t hist_size = groups << RADIX_BITS;
+    uint32_t hist_element = idx == "ulong" ? sizeof(cl_ulong) : sizeof(cl_uint);
+    auto hist = cl.alloc<char>(hist_size * hist_element);
+    cl::Buffer in = buf, out = cl.alloc<char>(element_size * size);
+    int passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    for (int pass = 0; pass < passes; ++pass) {
+      cl_uint shift = pass * RADIX_BITS;
+      kernel_histogram.setArg(0, in);
+      kernel_histogram.setArg(1, (cl_ulong)size);
+      kernel_histogram.setArg(2, shift);
+      kernel_histogram.setArg(3, hist);
+      kernel_histogram.setArg(4, (cl_ulong)groups);
+      cl.run_kernel_tiled(kernel_histogram, 5,
+          groups * clcfg.local_size, clcfg.local_size);
+      scan(cl, clcfg, hist, hist_element, hist_size, idx, "x + y", "0");
+      kernel_scatter.setArg(0, in);
+      kernel_scatter.setArg(1, out);
+      kernel_scatter.setArg(2, (cl_ulong)size);
+      kernel_scatter.setArg(3, shift);
+      kernel_scatter.setArg(4, hist);
+      kernel_scatter.setArg(5, (cl_ulong)groups);
+      cl.run_kernel_tiled(kernel_scatter, 6,
+          groups * clcfg.local_size, clcfg.local_size);
+      std::swap(in, out);
+    }
+    if (passes % 2)
+      cl.copy<char>(in, buf, element_size * size);
+  }
+
+  void test_radix_sort(OpenCLApp& cl, const OpenCLConfig& clcfg) {
+    for (int N : { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7 }) {
+      std::cout << "testing radix sort with " << N << " elements" << std::endl;
+      cl::Buffer buf = cl.alloc<uint32_t>(N);
+      std::vector<uint32_t> x(N), y(N);
+      for (int i = 0; i < N; ++i)
+        x[i] = std::rand()%1000;
+      cl.write_sync(buf, x.data(), N);
+
+      double t0 = utils::get_time();
+      std::sort(std::begin(x), std::end(x));
+      double t1 = utils::get_time();
+      radix_sort(cl, clcfg, buf, sizeof(uint32_t), N, 10, "uint", "x");
+      cl.finish_queue();
+      double t2 = utils::get_time();
+      std::cout << (t1-t0) << " " <<(t2-t1) << std::endl;
+
+      cl.read_sync(buf, y.data(), N);
+      if (x != y && N < 100) {
+        std::cout << "x="; for (auto a: x) std::cout << a << " "; std::cout << std::endl;
+        std::cout << "y="; for (auto a: y) std::cout << a << " "; std::cout << std::endl;
+      }
+      assert(x == y);
+    }
+  }
+}
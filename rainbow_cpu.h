@@ -1,52 +1,125 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "cpu_radix_sort.h"
 #include "hash.h"
 #include "rainbow_table.h"
 #include "utils.h"
 
-template <typename T, typename P>
-static void uniqify(std::vector<T>& vec, P eq) {
-  vec.resize(unique(std::begin(vec), std::end(vec), eq) - std::begin(vec));
-}
-
-template <typename T>
-static void uniqify(std::vector<T>& vec) {
-  vec.resize(unique(std::begin(vec), std::end(vec)) - std::begin(vec));
-}
-
 struct CPUImplementation {
+  static const int MAX_LANES = 16;
+
   RainbowTableParams p;
   utils::Stats& stats;
+  unsigned num_threads;
+  // number of chains we advance in lockstep with the multi-buffer MD5
+  int lanes;
+  // if non-zero, lookup() joins queries against the table in batches of
+  // this size (see lookup_batch)
+  std::uint64_t batch_size;
+  // sort the table without a second buffer, which is slower
+  bool inplace_sort = false;
 
-  CPUImplementation(const RainbowTableParams& p, utils::Stats& stats)
-    : p(p), stats(stats)
-  { }
+  // offset of the first string of every length, up to a sentinel past the
+  // longest one
+  std::vector<std::uint64_t> len_offset;
+  // the characters for every pair of digits, lower digit first. We extract
+  // two characters per division by alphabet_size^2, and once the index fits
+  // into 32 bits we divide by multiplying with pair_magic.
+  std::vector<std::uint16_t> digit_pairs;
+  std::uint64_t pair_base, pair_magic;
 
-  void string_from_index(std::uint64_t n, unsigned char* buf, std::uint64_t& len) {
+  CPUImplementation(const RainbowTableParams& p, utils::Stats& stats,
+      unsigned num_threads = utils::default_num_threads(),
+      std::uint64_t batch_size = 0)
+    : p(p), stats(stats), num_threads(std::max(1u, num_threads))
+    , lanes(md5_max_lanes()), batch_size(batch_size)
+  {
     std::uint64_t base = p.alphabet.size();
-    std::uint64_t offset = 0;
-    std::uint64_t num = 1;
-    len = 0;
-    while (offset + num <= n) {
+    std::uint64_t offset = 0, num = 1;
+    for (std::uint64_t len = 0; len <= p.max_string_len() + 1; ++len) {
+      len_offset.push_back(offset);
       offset += num;
       num *= base;
+    }
+    pair_base = base * base;
+    // the 32-bit division by pair_base is floor(n * pair_magic / 2^64)
+    pair_magic = std::numeric_limits<std::uint64_t>::max() / pair_base + 1;
+    digit_pairs.resize(pair_base);
+    for (std::uint64_t d = 0; d < pair_base; ++d) {
+      unsigned char c[2] = { (unsigned char)p.alphabet[d % base],
+                             (unsigned char)p.alphabet[d / base] };
+      std::memcpy(&digit_pairs[d], c, 2);
+    }
+  }
+
+  void string_from_index(std::uint64_t n, unsigned char* buf, std::uint64_t& len) {
+    len = 0;
+    while (len_offset[len + 1] <= n)
       len++;
+    n -= len_offset[len];
+    std::uint64_t i = 0;
+    for (; i + 1 < len && (n >> 32); i += 2) {
+      std::memcpy(buf + i, &digit_pairs[n % pair_base], 2);
+      n /= pair_base;
     }
-    n -= offset;
-    for (int i = 0; i < len; ++i) {
-      buf[i] = p.alphabet[n%base];
-      n/=base;
+    std::uint32_t m = n;
+    for (; i + 1 < len; i += 2) {
+      std::uint32_t q = ((unsigned __int128)pair_magic * m) >> 64;
+      std::memcpy(buf + i, &digit_pairs[m - q * pair_base], 2);
+      m = q;
     }
+    if (i < len)
+      buf[i] = p.alphabet[m];
   }
 
+  // Enumerates the strings with consecutive indices without decoding each
+  // of them from scratch
+  struct Odometer {
+    const std::string& alphabet;
+    unsigned char digits[64], buf[64];
+    std::uint64_t len;
+
+    Odometer(CPUImplementation& impl, std::uint64_t n)
+      : alphabet(impl.p.alphabet)
+    {
+      impl.string_from_index(n, buf, len);
+      // the digits come from the index rather than the characters, which
+      // may repeat in the alphabet
+      std::uint64_t m = n - impl.len_offset[len];
+      for (std::uint64_t i = 0; i < len; ++i) {
+        digits[i] = m % alphabet.size();
+        m /= alphabet.size();
+      }
+    }
+
+    void next() {
+      for (std::uint64_t i = 0; i < len; ++i) {
+        if (++digits[i] < alphabet.size()) {
+          buf[i] = alphabet[digits[i]];
+          return;
+        }
+        digits[i] = 0;
+        buf[i] = alphabet[0];
+      }
+      digits[len] = 0;
+      buf[len] = alphabet[0];
+      len++;
+    }
+  };
+
   std::string string_from_index(std::uint64_t n) {
     // TODO overflow?
-    unsigned char buf[20];
+    unsigned char buf[64];
     uint64_t len;
     string_from_index(n, buf, len);
     return std::string((char*)buf, (char*)buf + len);
@@ -56,14 +129,74 @@ struct CPUImplementation {
     uint32_t *hash = (uint32_t*)&h[0];
     uint64_t x = hash[0] | ((uint64_t)hash[1]<<32);
     x ^= round | (p.table_index<<32);
+    if (p.reduction == REDUCE_FASTRANGE)
+      return (std::uint64_t)(((unsigned __int128)(x * REDUCE_MIX) * p.num_strings) >> 64);
     return x % p.num_strings;
   }
 
   void compute_hash(std::uint64_t x, Hash& h) {
-    unsigned char buf[16];
+    uint32_t words[16];
     std::uint64_t len;
-    string_from_index(x, buf, len);
-    ::compute_hash(buf, len, h);
+    string_from_index(x, (unsigned char*)words, len);
+    md5_hash_short(words, (uint32_t)len, (uint32_t*)&h[0]);
+  }
+
+  // Puts the padded block for the string buf[0..len) into lane j of an
+  // interleaved multi-buffer MD5 block
+  void put_lane(uint32_t* block, int j, const unsigned char* buf, std::uint64_t len) {
+    uint32_t words[16] = {0};
+    std::memcpy(words, buf, len);
+    ((unsigned char*)words)[len] = 0x80;
+    words[14] = len << 3;
+    for (int k = 0; k < 16; ++k)
+      block[k * lanes + j] = words[k];
+  }
+
+  void hash_lanes(const uint32_t* block, Hash* hs) {
+    uint32_t hash[4 * MAX_LANES];
+    md5_hash_lanes(lanes, block, hash);
+    for (int j = 0; j < lanes; ++j)
+      for (int k = 0; k < 4; ++k)
+        ((uint32_t*)&hs[j][0])[k] = hash[k * lanes + j];
+  }
+
+  // Hashes the strings with indices xs[0..lanes) using one multi-buffer MD5
+  void compute_hashes(const std::uint64_t* xs, Hash* hs) {
+    uint32_t block[16 * MAX_LANES];
+    for (int j = 0; j < lanes; ++j) {
+      unsigned char buf[64];
+      std::uint64_t len;
+      string_from_index(xs[j], buf, len);
+      put_lane(block, j, buf, len);
+    }
+    hash_lanes(block, hs);
+  }
+
+  // Advances n <= lanes chains in lockstep. Chain j continues from hash hs[j]
+  // at iteration start_iteration[j] up to end_iteration and leaves its last
+  // value in xs[j] and its last hash in hs[j]. Chains that start late just
+  // idle in the first few steps.
+  void construct_chains(int n, Hash* hs, const std::uint64_t* start_iteration,
+      std::uint64_t end_iteration, std::uint64_t* xs)
+  {
+    assert(n <= lanes);
+    std::uint64_t first = end_iteration;
+    for (int j = 0; j < n; ++j)
+      first = std::min(first, start_iteration[j]);
+    Hash cur[MAX_LANES];
+    std::uint64_t x[MAX_LANES] = {0};
+    for (std::uint64_t i = first; i < end_iteration; ++i) {
+      for (int j = 0; j < n; ++j)
+        if (i >= start_iteration[j])
+          x[j] = reduce(hs[j], i);
+      compute_hashes(x, cur);
+      for (int j = 0; j < n; ++j) {
+        if (i >= start_iteration[j]) {
+          xs[j] = x[j];
+          hs[j] = cur[j];
+        }
+      }
+    }
   }
 
   std::pair<std::uint64_t,Hash> construct_chain(Hash h, std::uint64_t start_iteration, std::uint64_t end_iteration) {
@@ -85,11 +218,43 @@ struct CPUImplementation {
     return construct_chain(h, start_iteration, end_iteration);
   }
 
+  // Sorts the table by endpoint and keeps one chain per endpoint: the
+  // first one in table order, which after build() is the smallest start.
   void sort_and_uniqify(RainbowTable& rt) {
-    std::sort(std::begin(rt.table), std::end(rt.table));
-    uniqify(rt.table, [&](const RainbowTable::Entry& a, const RainbowTable::Entry& b) {
-      return a.first == b.first;
-    });
+    int bits = utils::bit_width(p.num_strings - 1);
+    if (inplace_sort)
+      cpu_primitives::sort_unique_inplace(rt.table, bits, num_threads);
+    else
+      cpu_primitives::radix_sort_unique(rt.table, bits, num_threads);
+  }
+
+  // Computes the chains for the start values [lo, hi) into out
+  void generate_chains(std::uint64_t lo, std::uint64_t hi,
+      RainbowTable::Entry* out)
+  {
+    std::uint64_t xs[MAX_LANES] = {0}, zero[MAX_LANES] = {0};
+    uint32_t block[16 * MAX_LANES] = {0};
+    Hash hs[MAX_LANES];
+    Odometer start_string(*this, lo);
+    for (std::uint64_t i = lo; i < hi; i += lanes) {
+      int n = std::min(std::uint64_t(lanes), hi - i);
+      for (int j = 0; j < n; ++j) {
+        put_lane(block, j, start_string.buf, start_string.len);
+        start_string.next();
+      }
+      hash_lanes(block, hs);
+      construct_chains(n, hs, zero, p.chain_len, xs);
+      for (int j = 0; j < n; ++j)
+        out[i - lo + j] = {xs[j], i + j};
+    }
+  }
+
+  // chunk of start values per scheduling step, many more chunks than
+  // threads, so that the dynamic scheduling can balance out differences in
+  // thread speed
+  std::uint64_t build_chunk() const {
+    return std::max(std::uint64_t{1}, std::min(std::uint64_t{1<<12},
+          p.num_start_values / (64 * num_threads)));
   }
 
   void build(RainbowTable& rt) {
@@ -100,12 +265,15 @@ struct CPUImplementation {
     }
     rt.table.resize(p.num_start_values);
     utils::Progress progress(p.num_start_values);
+    std::atomic<std::uint64_t> done(0);
     stats.add_timing("time_generate", [&]() {
-      for (std::uint64_t i = 0; i < p.num_start_values; ++i) {
-        progress.report(i);
-        std::uint64_t start = offset + i;
-        rt.table[i] = {construct_chain(start, 0, p.chain_len).first, start};
-      }
+      utils::parallel_for(num_threads, 0, p.num_start_values, build_chunk(),
+          [&](unsigned thread_id, std::uint64_t lo, std::uint64_t hi) {
+        generate_chains(offset + lo, offset + hi, &rt.table[lo]);
+        done += hi - lo;
+        if (thread_id == 0)
+          progress.report(done);
+      });
     });
     progress.finish();
     stats.add_timing("time_sort", [&]() {
@@ -113,33 +281,220 @@ struct CPUImplementation {
     });
   }
 
-  std::uint64_t lookup_single(const RainbowTable& rt, const Hash& h) {
-    for (int i = 0; i < p.chain_len; ++i) {
-      std::uint64_t endpoint = construct_chain(h, i, p.chain_len).first;
-      auto l = std::lower_bound(std::begin(rt.table), std::end(rt.table),
-          std::make_pair(endpoint, std::uint64_t{0}));
-      auto r = std::upper_bound(std::begin(rt.table), std::end(rt.table),
-          std::make_pair(endpoint, std::numeric_limits<std::uint64_t>::max()));
-      for (auto it = l; it != r; ++it) {
-        std::uint64_t start = it->second;
-        auto candidate = construct_chain(start, 0, i);
-        if (candidate.second == h)
-          return candidate.first;
+  // Like build(rt), but only for the chunks of start values the threads
+  // take from work, which they may share with other engines. The chunks
+  // are put back in the order of their start values before the sort, so
+  // that the chain kept for every endpoint is still the smallest start.
+  void build(utils::WorkQueue& work, RainbowTable& rt) {
+    using Chunk = std::pair<std::uint64_t, std::vector<RainbowTable::Entry>>;
+    std::vector<std::vector<Chunk>> chunks(num_threads);
+    std::uint64_t chunk = build_chunk();
+    stats.add_timing("time_generate", [&]() {
+      utils::parallel_for(num_threads, 0, num_threads, 1,
+          [&](unsigned thread_id, std::uint64_t, std::uint64_t) {
+        std::uint64_t lo, hi;
+        while (work.take(chunk, lo, hi)) {
+          chunks[thread_id].emplace_back(
+              lo, std::vector<RainbowTable::Entry>(hi - lo));
+          generate_chains(lo, hi, chunks[thread_id].back().second.data());
+        }
+      });
+    });
+    std::vector<Chunk> all;
+    for (auto& c : chunks)
+      std::move(c.begin(), c.end(), std::back_inserter(all));
+    std::sort(all.begin(), all.end(),
+        [](const Chunk& a, const Chunk& b) { return a.first < b.first; });
+    rt.table.clear();
+    for (auto& c : all) {
+      rt.table.insert(rt.table.end(), c.second.begin(), c.second.end());
+      std::vector<RainbowTable::Entry>().swap(c.second);
+    }
+    stats.add("chains_generated", rt.table.size());
+    stats.add_timing("time_sort", [&]() {
+      sort_and_uniqify(rt);
+    });
+  }
+
+  // Tries the chain positions [i0, i0 + lanes) for h. Returns the preimage
+  // found at the smallest of these positions and stores that position in pos.
+  std::uint64_t lookup_positions(const RainbowTable& rt, const Hash& h,
+      std::uint64_t i0, std::uint64_t& pos)
+  {
+    std::uint64_t endpoints[MAX_LANES], start_iteration[MAX_LANES];
+    Hash hs[MAX_LANES];
+    int n = std::min(std::uint64_t(lanes), p.chain_len - i0);
+    for (int j = 0; j < n; ++j) {
+      hs[j] = h;
+      start_iteration[j] = i0 + j;
+    }
+    construct_chains(n, hs, start_iteration, p.chain_len, endpoints);
+    for (int j = 0; j < n; ++j) {
+      std::uint64_t start = find_chain(rt, h, endpoints[j], i0 + j);
+      if (start != NOT_FOUND) {
+        pos = i0 + j;
+        return start;
       }
     }
     return NOT_FOUND;
   }
 
+  std::uint64_t lookup_single(const RainbowTable& rt, const Hash& h) {
+    for (std::uint64_t i0 = 0; i0 < p.chain_len; i0 += lanes) {
+      std::uint64_t pos;
+      std::uint64_t res = lookup_positions(rt, h, i0, pos);
+      if (res != NOT_FOUND)
+        return res;
+    }
+    return NOT_FOUND;
+  }
+
+  // Looks for a chain in the table that ends in `endpoint` and has h at
+  // position i. Returns the preimage of h or NOT_FOUND.
+  std::uint64_t find_chain(const RainbowTable& rt, const Hash& h,
+      std::uint64_t endpoint, std::uint64_t i)
+  {
+    std::uint64_t start;
+    if (!rt.find(endpoint, start))
+      return NOT_FOUND;
+    auto candidate = construct_chain(start, 0, i);
+    return candidate.second == h ? candidate.first : NOT_FOUND;
+  }
+
+  // Looks up a whole batch of queries at once: computes the endpoints of
+  // all (query, position) pairs, radix sorts them and joins them against
+  // the sorted table in one sequential pass. Only chains whose endpoint
+  // matched are regenerated. This replaces two random binary searches per
+  // candidate by streaming access over the table. Compressed tables are
+  // probed once per candidate instead, which is cheap for them.
+  void lookup_batch(const RainbowTable& rt, const Hash* queries,
+      std::uint64_t num_queries, std::uint64_t* res)
+  {
+    using cpu_primitives::KeyValue;
+    std::uint64_t t = p.chain_len;
+    std::uint64_t groups = (t + lanes - 1) / lanes;
+    // (endpoint, position * num_queries + query)
+    std::vector<KeyValue> candidates(t * num_queries);
+    stats.add_timing("time_compute_endpoints", [&]() {
+      std::atomic<std::uint64_t> done(0);
+      utils::Progress progress(groups * num_queries);
+      utils::parallel_for(num_threads, 0, groups * num_queries, 1,
+          [&](unsigned thread_id, std::uint64_t item, std::uint64_t) {
+        std::uint64_t q = item % num_queries;
+        std::uint64_t i0 = item / num_queries * lanes;
+        std::uint64_t endpoints[MAX_LANES], start_iteration[MAX_LANES];
+        Hash hs[MAX_LANES];
+        int n = std::min(std::uint64_t(lanes), t - i0);
+        for (int j = 0; j < n; ++j) {
+          hs[j] = queries[q];
+          start_iteration[j] = i0 + j;
+        }
+        construct_chains(n, hs, start_iteration, t, endpoints);
+        for (int j = 0; j < n; ++j) {
+          std::uint64_t id = (i0 + j) * num_queries + q;
+          candidates[id] = {endpoints[j], id};
+        }
+        done++;
+        if (thread_id == 0)
+          progress.report(done);
+      });
+      progress.finish();
+    });
+    stats.add_timing("time_query_sort", [&]() {
+      cpu_primitives::radix_sort(candidates,
+          utils::bit_width(p.num_strings - 1), num_threads);
+    });
+    std::vector<std::uint64_t> found_pos(num_queries, t);
+    std::fill(res, res + num_queries, NOT_FOUND);
+    std::mutex res_mutex;
+    stats.add_timing("time_lookup_endpoints", [&]() {
+      // every range of candidates does one binary search for its first
+      // endpoint and then merges with the table from there
+      std::uint64_t chunk = std::max(std::uint64_t{1},
+          candidates.size() / (16 * num_threads));
+      auto check = [&](std::uint64_t c, std::uint64_t start) {
+        std::uint64_t q = candidates[c].second % num_queries;
+        std::uint64_t pos = candidates[c].second / num_queries;
+        auto candidate = construct_chain(start, 0, pos);
+        if (candidate.second == queries[q]) {
+          std::lock_guard<std::mutex> lock(res_mutex);
+          if (pos < found_pos[q]) {
+            found_pos[q] = pos;
+            res[q] = candidate.first;
+          }
+        }
+      };
+      utils::parallel_for(num_threads, 0, candidates.size(), chunk,
+          [&](unsigned, std::uint64_t lo, std::uint64_t hi) {
+        if (rt.is_compressed()) {
+          for (std::uint64_t c = lo; c < hi; ++c) {
+            std::uint64_t start;
+            if (rt.find(candidates[c].first, start))
+              check(c, start);
+          }
+          return;
+        }
+        auto it = std::lower_bound(rt.begin(), rt.end(),
+            std::make_pair(candidates[lo].first, std::uint64_t{0}));
+        for (std::uint64_t c = lo; c < hi; ++c) {
+          std::uint64_t endpoint = candidates[c].first;
+          while (it != rt.end() && it->first < endpoint)
+            ++it;
+          if (it != rt.end() && it->first == endpoint)
+            check(c, it->second);
+        }
+      });
+    });
+  }
+
   std::vector<std::uint64_t> lookup(
       const RainbowTable& table,
       const std::vector<Hash>& queries)
   {
-    std::vector<std::uint64_t> res;
-    utils::Progress prog(queries.size());
-    for (size_t i = 0; i < queries.size(); ++i) {
-      prog.report(i);
-      res.push_back(lookup_single(table, queries[i]));
+    if (batch_size) {
+      std::vector<std::uint64_t> res(queries.size());
+      for (std::uint64_t lo = 0; lo < queries.size(); lo += batch_size) {
+        std::uint64_t num = std::min(batch_size, queries.size() - lo);
+        lookup_batch(table, queries.data() + lo, num, res.data() + lo);
+      }
+      return res;
     }
+    // One work item per query and group of `lanes` chain positions. Position
+    // i costs t - i hashes, so we hand out the items group by group, which
+    // starts the expensive ones first and leaves the cheap ones to fill the
+    // gaps at the end.
+    std::uint64_t num_queries = queries.size();
+    std::uint64_t groups = (p.chain_len + lanes - 1) / lanes;
+    std::uint64_t items = groups * num_queries;
+    // smallest chain position at which a query has been resolved so far.
+    // Items at later positions are skipped.
+    std::unique_ptr<std::atomic<std::uint64_t>[]> found_pos(
+        new std::atomic<std::uint64_t>[num_queries]);
+    for (std::uint64_t q = 0; q < num_queries; ++q)
+      found_pos[q] = p.chain_len;
+    std::vector<std::uint64_t> res(num_queries, NOT_FOUND);
+    std::mutex res_mutex;
+    std::atomic<std::uint64_t> done(0);
+    utils::Progress prog(items);
+    utils::parallel_for(num_threads, 0, items, 1,
+        [&](unsigned thread_id, std::uint64_t item, std::uint64_t) {
+      std::uint64_t q = item % num_queries;
+      std::uint64_t i0 = item / num_queries * lanes;
+      if (i0 < found_pos[q]) {
+        std::uint64_t pos;
+        std::uint64_t x = lookup_positions(table, queries[q], i0, pos);
+        if (x != NOT_FOUND) {
+          std::lock_guard<std::mutex> lock(res_mutex);
+          if (pos < found_pos[q]) {
+            found_pos[q] = pos;
+            res[q] = x;
+          }
+        }
+      }
+      done++;
+      if (thread_id == 0)
+        prog.report(done);
+    });
     prog.finish();
     return res;
   }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <fstream>
 #include <limits>
+#include <map>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -17,21 +20,107 @@
 namespace ocl_code {
 #include "md5.cl.h"
 #include "kernels.cl.h"
-#include "radix_sort.cl.h"
   std::string md5_cl_str(md5_cl, md5_cl + md5_cl_len);
   std::string kernels_cl_str(kernels_cl, kernels_cl + kernels_cl_len);
-  std::string radix_sort_cl_str(radix_sort_cl, radix_sort_cl + radix_sort_cl_len);
 }
 
+// Tables uploaded to the device and kept there across lookups, so that
+// looking up many query sets against the same tables uploads every table
+// only once. Tables are identified by a name chosen by the caller, usually
+// the file name. The least recently used tables are evicted when the
+// uploaded tables would exceed budget bytes.
+class ResidentTables {
+  struct Resident {
+    cl::Buffer buf;
+    std::uint64_t bytes, last_use;
+  };
+  OpenCLApp& cl;
+  std::map<std::string, Resident> tables;
+  std::uint64_t total = 0, clock = 0;
+
+public:
+  std::uint64_t budget;
+
+  ResidentTables(OpenCLApp& cl, std::uint64_t budget)
+    : cl(cl), budget(budget) {}
+
+  // Returns the device copy of rt, uploading it if it is not resident yet.
+  // A table larger than the budget is uploaded, but not kept.
+  cl::Buffer get(const std::string& name, const RainbowTable& rt) {
+    auto it = tables.find(name);
+    if (it != tables.end()) {
+      it->second.last_use = ++clock;
+      return it->second.buf;
+    }
+    std::uint64_t bytes = rt.size() * sizeof(RainbowTable::Entry);
+    // a table that could never be kept leaves the resident ones alone
+    while (bytes <= budget && !tables.empty() && total + bytes > budget) {
+      auto lru = std::min_element(tables.begin(), tables.end(),
+          [](const std::pair<const std::string, Resident>& a,
+             const std::pair<const std::string, Resident>& b) {
+            return a.second.last_use < b.second.last_use;
+          });
+      evict(lru->first);
+    }
+    std::vector<RainbowTable::Entry> flat_buf;
+    auto buf = cl.alloc<RainbowTable::Entry>(rt.size(), CL_MEM_READ_ONLY);
+    cl.write_sync(buf, rt.flat(flat_buf), rt.size());
+    if (bytes <= budget) {
+      tables[name] = Resident { buf, bytes, ++clock };
+      total += bytes;
+    }
+    return buf;
+  }
+
+  // The device memory is released once no lookup uses the table anymore
+  void evict(const std::string& name) {
+    auto it = tables.find(name);
+    if (it == tables.end())
+      return;
+    total -= it->second.bytes;
+    tables.erase(it);
+  }
+
+  void clear() {
+    tables.clear();
+    total = 0;
+  }
+
+  bool contains(const std::string& name) const {
+    return tables.count(name);
+  }
+
+  std::uint64_t bytes() const {
+    return total;
+  }
+};
+
 struct GPUImplementation {
   RainbowTableParams p;
-  OpenCLApp cl;
+  OpenCLApp& cl;
   bool verify;
   CPUImplementation& cpu;
   utils::Stats& stats;
   uint64_t block_size;
   const OpenCLConfig& clcfg;
   cl::Buffer alphabet_buf;
+  // wait for the device after every round of the build and every lookup
+  // batch, so that a display driven by the same GPU stays responsive
+  bool throttle = false;
+  // device memory per lookup batch in bytes, 0 to derive it from the
+  // device memory size
+  std::uint64_t batch_memory = 0;
+  // if set, lookups of named tables keep them on the device
+  ResidentTables* resident = nullptr;
+  // Out-of-core builds: if run_size is set, build() writes sorted runs of
+  // at most run_size unique chains to run_prefix.0, run_prefix.1, ... and
+  // lists them in runs instead of filling the table. The runs still have
+  // to be merged, see cpu_primitives::merge_unique_runs.
+  std::uint64_t run_size = 0;
+  std::string run_prefix;
+  std::vector<std::string> runs;
+  // no progress output, for all but one of several devices working together
+  bool quiet = false;
 
   cl::Kernel
     kernel_generate_chains,
@@ -52,12 +141,22 @@ struct GPUImplementation {
     : p(p), cl(cl), cpu(cpu), stats(stats), verify(verify)
     , block_size(block_size), clcfg(clcfg)
   {
+    std::stringstream len_offsets;
+    for (auto offset : cpu.len_offset)
+      len_offsets << offset << "UL, ";
     std::stringstream defines;
     defines
+      << "#define LEN_OFFSETS " << len_offsets.str() << std::endl
       << "#define ALPHA_SIZE " << p.alphabet.size() << std::endl
       << "#define TABLE_INDEX " << p.table_index << std::endl
       << "#define NUM_STRINGS " << p.num_strings << std::endl
       << "#define CHAIN_LEN " << p.chain_len << std::endl
+      << "#define POS_BITS " << pos_bits() << std::endl
+      << "#define REDUCE_MODULO " << REDUCE_MODULO << std::endl
+      << "#define REDUCE_FASTRANGE " << REDUCE_FASTRANGE << std::endl
+      << "#define REDUCTION " << p.reduction << std::endl
+      << "#define REDUCE_MIX " << REDUCE_MIX << "UL" << std::endl
+      << "#define STRING_WORDS " << p.max_string_len() / 4 + 1 << std::endl
       << "#define BLOCK_SIZE " << block_size << std::endl
       << "#define LOCAL_SIZE " << clcfg.local_size << std::endl
       << "#define GLOBAL_SIZE " << clcfg.global_size << std::endl
@@ -78,85 +177,17 @@ struct GPUImplementation {
     cl.write_async(alphabet_buf, p.alphabet.c_str(), p.alphabet.size());
   }
 
-  void prefix_scan(cl::Buffer in, cl::Buffer out, uint64_t size) {
-    //assert(in != out);
-    std::vector<uint32_t> local(size);
-    cl.read_sync<uint32_t>(in, local.data(), size);
-    uint32_t acc = 0;
-    for (uint64_t i = 0; i < size; ++i) {
-      uint32_t x = local[i];
-      local[i] = acc;
-      acc += x;
-    }
-    cl.write_sync<uint32_t>(out, local.data(), size);
+  // bits of a lookup candidate that hold the chain position, the query
+  // index gets the rest of the 64-bit word
+  int pos_bits() const {
+    return std::max(1, utils::bit_width(p.chain_len - 1));
   }
 
-  void run(cl::Kernel kernel, uint64_t size) {
+  void run(cl::Kernel kernel, uint64_t size,
+      const std::vector<cl::Event>* wait=nullptr, cl::Event* done=nullptr) {
     cl.run_kernel(kernel,
         cl::NDRange(utils::round_to_multiple(size, uint64_t{clcfg.local_size})),
-        cl::NDRange(clcfg.local_size));
-  }
-
-  void sort(
-      cl::Buffer buf, int objsize, std::uint32_t bufsize,
-      int bits,
-      const std::string& type, const std::string& getbit
-      )
-  {
-    assert(bufsize <= std::numeric_limits<std::uint32_t>::max());
-    uint32_t scan_count = utils::round_to_multiple(bufsize + clcfg.local_size, clcfg.local_size);
-    auto offset_buf = cl.alloc<std::uint32_t>(scan_count);
-    auto buf1 = buf;
-    auto buf2 = cl.alloc<char>(objsize * bufsize);
-    auto defines = std::string()
-      + "#define GET_BIT(x, b) (" + getbit + ")\n"
-      + "#define T " + type + "\n"
-      + "#define LOCAL_SIZE " + std::to_string(clcfg.local_size) + "\n";
-    auto prog = cl.build_program(std::vector<std::string> {
-      defines,
-      ocl_code::radix_sort_cl_str
-    });
-    auto kernel_write_bits = cl.get_kernel(prog, "write_bits");
-    auto kernel_partition = cl.get_kernel(prog, "partition");
-    kernel_write_bits.setArg(1, (cl_uint)bufsize);
-    kernel_partition.setArg(2, (cl_uint)bufsize);
-    double t = 0;
-    for (int b = 0; b < bits; ++b) {
-      kernel_write_bits.setArg(0, buf1);
-      kernel_write_bits.setArg(2, (cl_int)b);
-      kernel_write_bits.setArg(3, offset_buf);
-
-      kernel_partition.setArg(0, buf1);
-      kernel_partition.setArg(1, buf2);
-      kernel_partition.setArg(3, offset_buf);
-
-      for (uint32_t offset = 0; offset < scan_count; offset += clcfg.global_size) {
-        kernel_write_bits.setArg(4, (cl_uint)offset);
-        uint32_t count = std::min(clcfg.global_size, scan_count - offset);
-        run(kernel_write_bits, count);
-        cl.finish_queue();
-      }
-
-      double t0 = utils::get_time();
-      prefix_scan(offset_buf, offset_buf, scan_count);
-      t += utils::get_time()-t0;
-      //std::cout << "FOO" << std::endl;
-      //std::vector<uint32_t> x(scan_count);
-      //cl.read_sync(offset_buf, x.data(), scan_count);
-      //int i = 0;
-      //for (auto a: x) std::cout << (i++)<<":" << a << " "; std::cout << std::endl;
-
-      for (uint32_t offset = 0; offset < bufsize; offset += clcfg.global_size) {
-        kernel_partition.setArg(4, (cl_uint)offset);
-        uint32_t count = std::min(clcfg.global_size, bufsize - offset);
-        run(kernel_partition, count);
-        cl.finish_queue();
-      }
-      std::swap(buf1, buf2);
-    }
-    std::cout << "scan time " << t << std::endl;
-    if (bits & 1)
-      cl.copy<char>(buf1, buf, objsize * bufsize);
+        cl::NDRange(clcfg.local_size), wait, done);
   }
 
   void benchmark_hash_and_reduce(uint32_t iters) {
@@ -202,72 +233,174 @@ struct GPUImplementation {
     }
   }
 
-  void build(RainbowTable& rt) {
+  // Device memory that compacting n chains needs at most on top of the
+  // table: the radix sort's second buffer, the filter's flags and its
+  // output.
+  static std::uint64_t compaction_scratch(std::uint64_t n) {
     using C = std::pair<cl_ulong,cl_ulong>;
-    //auto chain_buf = cl.alloc<cl_ulong>(2 * clcfg.global_size * block_size);
-    //auto debug_buf = cl.alloc<cl_ulong>(global_size * block_size);
+    return n * (2 * sizeof(C) + sizeof(cl_ulong));
+  }
+
+  // Chains the build arena holds. All start values if they fit, otherwise
+  // what the device memory allows next to the staging buffers and the
+  // compaction scratch space.
+  std::uint64_t arena_capacity(std::uint64_t round) {
+    using C = std::pair<cl_ulong,cl_ulong>;
+    std::uint64_t mem = cl.global_mem_size() / 4 * 3;
+    std::uint64_t staging = 2 * round * sizeof(C);
+    std::uint64_t fit = mem > staging
+      ? (mem - staging) / (sizeof(C) + compaction_scratch(1)) : 0;
+    fit = std::min(fit, cl.max_alloc_size() / sizeof(C));
+    return std::min(fit, p.num_start_values + round);
+  }
 
+  // Chains are generated in rounds of IN_FLIGHT chunks into one of two
+  // staging buffers. While the main queue generates round r, a second
+  // queue appends round r - 1 to the table and compacts the table when it
+  // has doubled since the last compaction, or when the next round would
+  // not fit. The queues only wait for each other through events, so the
+  // host never stalls the generation, except with throttle set.
+  //
+  // The table lives in an arena allocated once. It holds every chain if
+  // the device has room for that, otherwise as many as the compaction
+  // scratch space leaves room for. Out-of-core builds empty the arena into
+  // a run file whenever it holds run_size chains after a compaction.
+  void build(RainbowTable& rt) {
     uint64_t lo = p.table_index * p.num_start_values;
-    uint64_t hi = lo + p.num_start_values;
+    utils::WorkQueue work(lo, lo + p.num_start_values);
+    build(work, rt);
+  }
+
+  // Like build(rt), but only for the rounds of start values this device
+  // takes from work, which it may share with other devices
+  void build(utils::WorkQueue& work, RainbowTable& rt) {
+    using C = std::pair<cl_ulong,cl_ulong>;
+    const uint64_t IN_FLIGHT = 4;
 
-    kernel_generate_chains.setArg(1, (cl_ulong)hi);
     kernel_generate_chains.setArg(2, alphabet_buf);
-    //kernel_generate_chains.setArg(5, debug_buf);
 
-    uint64_t bufsize = 1<<20;
-    auto chain_buf = cl.alloc<C>(bufsize);
+    OpenCLApp aux = cl.fork_queue();
     uint64_t chunk = block_size * clcfg.global_size;
+    uint64_t round = std::min(IN_FLIGHT * chunk,
+        std::max(uint64_t{1}, p.num_start_values));
+    cl::Buffer staging[2] = { cl.alloc<C>(round), cl.alloc<C>(round) };
+    // gen_done[b] fires when staging[b] is filled, copy_done[b] when it
+    // has been appended to the table and can be filled again
+    std::vector<cl::Event> gen_done(2), copy_done(2);
+    bool staged[2] = { false, false };
+    uint64_t staged_count[2] = { 0, 0 };
+
+    uint64_t capacity = arena_capacity(round);
+    if (run_size)
+      capacity = std::min(capacity, run_size + round);
+    if (capacity < round) {
+      std::cerr << "ERROR: Not enough device memory for the table" << std::endl;
+      exit(1);
+    }
+    auto chain_buf = cl.alloc<C>(capacity);
     uint64_t total = 0, last_compaction = chunk;
+    uint64_t peak_memory = (capacity + 2 * round) * sizeof(C);
+    int endpoint_bits = utils::bit_width(p.num_strings - 1);
+    runs.clear();
+
+    // writes the compacted arena to the next run file and empties it
+    auto spill = [&]() {
+      stats.add_timing("time_write_runs", [&]() {
+        std::vector<C> buf(total);
+        aux.read_sync(chain_buf, buf.data(), total);
+        runs.push_back(run_prefix + "." + std::to_string(runs.size()));
+        std::ofstream f(runs.back(), std::ios::binary);
+        f.write((char*)buf.data(), total * sizeof(C));
+        if (!f) {
+          std::cerr << "ERROR: Cannot write " << runs.back() << std::endl;
+          exit(1);
+        }
+      });
+      total = 0;
+      last_compaction = chunk;
+    };
+
+    // runs on aux, after generation of staging[b] completed
+    auto append = [&](int b, bool last) {
+      uint64_t count = staged_count[b];
+      std::vector<cl::Event> wait(1, gen_done[b]);
+      aux.copy_after<C>(staging[b], chain_buf, count, 0, total, wait,
+          copy_done[b]);
+      aux.flush_queue();
+      total += count;
+      if (total > 2*last_compaction || total + round > capacity || last) {
+        peak_memory = std::max(peak_memory,
+            (capacity + 2 * round) * sizeof(C) + compaction_scratch(total));
+        // blocks until the new size is known, but the main queue keeps
+        // generating meanwhile
+        stats.add_timing("time_compaction", [&]() {
+          total = ocl_primitives::remove_dups_inplace(
+              aux, clcfg, chain_buf, sizeof(C), total, endpoint_bits,
+              "ulong2", "x.x");
+        });
+        last_compaction = total;
+        if (run_size && (last || total >= run_size || total + round > capacity))
+          spill();
+        else if (!last && total + round > capacity) {
+          std::cerr << "ERROR: Table does not fit into device memory" << std::endl;
+          exit(1);
+        }
+      }
+    };
+
     stats.add_timing("time_generate", [&]() {
-      utils::Progress progress(hi - lo);
-      uint64_t iter = 0;
-      for (uint64_t offset = lo; offset < hi; offset += chunk) {
-        progress.report(offset - lo);
-        uint64_t count = std::min(chunk, hi - offset);
-        //std::cout << "count="<< count << " bufsize=" << bufsize << " total=" << total << std::endl;
-        while (total + count > bufsize) {
-          auto new_chain_buf = cl.alloc<C>(2*bufsize);
-          cl.finish_queue();
-          stats.add_timing("time_realloc", [&]() {
-            cl.copy<C>(chain_buf, new_chain_buf, bufsize);
-            cl.finish_queue();
-          });
-          chain_buf = new_chain_buf;
-          bufsize *= 2;
+      utils::Progress progress(work.size());
+      int b = 0;
+      bool first = true;
+      uint64_t offset, end;
+      for (; work.take(round, offset, end); b ^= 1, first = false) {
+        if (!quiet)
+          progress.report(work.taken());
+        uint64_t count = end - offset;
+        stats.add("chains_generated", count);
+        kernel_generate_chains.setArg(1, (cl_ulong)end);
+        kernel_generate_chains.setArg(3, staging[b]);
+        for (uint64_t i = 0; i < count; i += chunk) {
+          uint64_t n = std::min(chunk, count - i);
+          kernel_generate_chains.setArg(0, (cl_ulong)(offset + i));
+          kernel_generate_chains.setArg(4, (cl_ulong)i);
+          // the first chunk must not overwrite staging[b] before the
+          // previous contents were appended, the last one signals that the
+          // round is complete
+          std::vector<cl::Event> wait;
+          if (i == 0 && staged[b])
+            wait.push_back(copy_done[b]);
+          bool last_chunk = i + chunk >= count;
+          run(kernel_generate_chains, (n + block_size - 1) / block_size, &wait,
+              last_chunk ? &gen_done[b] : nullptr);
         }
-        //std::cout << "new bufsize=" << bufsize << std::endl;
-        kernel_generate_chains.setArg(0, (cl_ulong)offset);
-        kernel_generate_chains.setArg(3, chain_buf);
-        kernel_generate_chains.setArg(4, (cl_ulong)total);
-
-        run(kernel_generate_chains, count);
-        total += count;
-        if (total > 2*last_compaction || offset + chunk >= hi) {
-          //std::cout << "Compacting. Before: " << total << " After: ";
+        cl.flush_queue();
+        staged[b] = true;
+        staged_count[b] = count;
+        if (!first)
+          append(b ^ 1, false);
+        if (throttle) {
+          // responsiveness
           cl.finish_queue();
-          stats.add_timing("time_compaction", [&]() {
-            total = ocl_primitives::remove_dups_inplace(
-                cl, clcfg, chain_buf, sizeof(C), total, "ulong2", "x.x < y.x");
-            cl.finish_queue();
-          });
-          //std::cout << total << std::endl;
-          last_compaction = total;
+          usleep(1000);
         }
-        //std::vector<uint64_t> debug(clcfg.global_size*block_size);
-        //cl.read_sync(debug_buf, debug.data(), count);
-        //std::cout << std::endl;
-        //for (int i = 0; i < count; ++i)
-          //std::cout << debug[i] << " ";
-        //std::cout << std::endl;
-
-        // responsiveness
-        cl.finish_queue();
-        usleep(1000);
       }
-      progress.finish();
+      if (!first)
+        append(b ^ 1, true);
+      aux.finish_queue();
+      if (!quiet)
+        progress.finish();
     });
+    if (!quiet)
+      std::cout << "Device memory peak: " << (peak_memory >> 20) << " MiB" << std::endl;
+    stats.add("device_memory_peak_mib", peak_memory >> 20);
+    if (run_size) {
+      if (!quiet)
+        std::cout << "Wrote " << runs.size() << " sorted runs" << std::endl;
+      return;
+    }
     rt.table.resize(total);
-    cl.read_sync(chain_buf, rt.table.data(), total);
+    aux.read_sync(chain_buf, rt.table.data(), total);
 
     if (verify) {
       stats.add_timing("time_sort", [&]() {
@@ -289,7 +422,7 @@ struct GPUImplementation {
       //assert(rt.table[i].first == i && rt.table[i].second == i);
   }
 
-  void fill_ulong(cl::Buffer buf, std::uint32_t size, std::uint64_t a, uint64_t b=0) {
+  void fill_ulong(cl::Buffer buf, std::uint64_t size, std::uint64_t a, uint64_t b=0) {
     kernel_fill_ulong.setArg(0, buf);
     kernel_fill_ulong.setArg(1, (cl_ulong)size);
     kernel_fill_ulong.setArg(2, (cl_ulong)a);
@@ -297,116 +430,175 @@ struct GPUImplementation {
     run(kernel_fill_ulong, size);
   }
 
+  // Number of queries per lookup batch. A batch needs 16 bytes of device
+  // memory per chain position of every query, and as much again while
+  // sorting. Two batches are in flight at a time. Unless batch_memory is
+  // set, they may use three quarters of the device memory that the tables
+  // leave free.
+  std::uint64_t lookup_batch_size(std::uint64_t num_queries,
+      std::uint64_t table_bytes)
+  {
+    std::uint64_t endpoint_bytes = p.chain_len * 2 * sizeof(cl_ulong);
+    std::uint64_t per_query = 2 * endpoint_bytes + sizeof(Hash) + sizeof(cl_ulong);
+    std::uint64_t budget = batch_memory;
+    if (!budget) {
+      std::uint64_t mem = cl.global_mem_size() / 4 * 3;
+      budget = mem > table_bytes ? (mem - table_bytes) / 2 : 0;
+    }
+    std::uint64_t n = std::min(budget / per_query,
+        cl.max_alloc_size() / endpoint_bytes);
+    // the kernels index the queries of a batch with int
+    n = std::min(n, std::uint64_t{std::numeric_limits<int32_t>::max()});
+    n = std::min(n, std::uint64_t{1} << (64 - pos_bits()) >> 1);
+    return std::max(std::uint64_t{1}, std::min(n, num_queries));
+  }
+
+  // Streams the queries through the device in batches. For every batch,
+  // the endpoints of all chain positions are computed, sorted on the
+  // device and joined against the table. Only the results are read back,
+  // while the device already works on the next batch.
+  // If name is given and resident is set, the table stays on the device
+  // for later lookups.
   std::vector<std::uint64_t> lookup(
       const RainbowTable& rt,
-      const std::vector<Hash>& queries)
+      const std::vector<Hash>& queries,
+      const std::string& name = "")
   {
-    std::uint64_t hi = p.chain_len * queries.size();
-    auto query_buf = cl.alloc<Hash>(queries.size(), CL_MEM_READ_ONLY);
-    auto lookup_buf = cl.alloc<cl_ulong>(4 * hi);
-    cl.write_async(query_buf, queries.data(), queries.size());
-    auto debug_buf = cl.alloc<cl_ulong>(hi);
-
-    kernel_compute_endpoints.setArg(1, (cl_ulong)hi);
-    kernel_compute_endpoints.setArg(2, alphabet_buf);
-    kernel_compute_endpoints.setArg(3, query_buf);
-    kernel_compute_endpoints.setArg(4, (cl_int)queries.size());
-    kernel_compute_endpoints.setArg(5, lookup_buf);
-
-    stats.add_timing("time_compute_endpoints", [&]() {
-      utils::Progress progress(hi);
-      for (uint64_t offset = 0; offset < hi; offset += clcfg.global_size) {
-        progress.report(offset);
-        kernel_compute_endpoints.setArg(0, (cl_ulong)offset);
-        size_t count = std::min(uint64_t{clcfg.global_size}, hi - offset);
-        run(kernel_compute_endpoints, count);
-        // responsiveness
-        cl.finish_queue();
-        usleep(1000);
-      }
-      progress.finish();
-    });
+    std::vector<std::uint64_t> res(queries.size(), NOT_FOUND);
+    if (queries.empty())
+      return res;
+    utils::WorkQueue work(0, queries.size());
+    lookup(rt, queries, work, res, name);
 
     if (verify) {
       stats.add_timing("time_verify", [&]() {
-        std::vector<std::array<std::uint64_t,4>> lookup(hi);
-        cl.read_sync(lookup_buf, lookup.data(), lookup.size());
-        for (std::uint64_t i = 0; i < hi; ++i) {
-          int start_iteration = i / queries.size();
-          int query_idx = i % queries.size();
-          assert(lookup[i][1] == start_iteration);
-          assert(lookup[i][2] == query_idx);
-          std::uint64_t endpoint = cpu.construct_chain(
-            queries[query_idx], start_iteration, p.chain_len).first;
-          assert(lookup[i][0] == endpoint);
+        for (std::uint64_t i = 0; i < queries.size(); ++i) {
+          std::uint64_t cmp = cpu.lookup_single(rt, queries[i]);
+          assert(cmp == res[i]);
         }
       });
     }
+    return res;
+  }
 
-    std::vector<std::array<std::uint64_t,4>> lookup(hi);
-    cl.read_sync(lookup_buf, lookup.data(), lookup.size());
-    stats.add_timing("time_query_sort", [&]() {
-      std::sort(std::begin(lookup), std::end(lookup));
+  // Like lookup(rt, queries), but only for the batches of queries this
+  // device takes from work, which it may share with other devices. Stores
+  // the results in res, which must hold one entry per query.
+  void lookup(
+      const RainbowTable& rt,
+      const std::vector<Hash>& queries,
+      utils::WorkQueue& work,
+      std::vector<std::uint64_t>& res,
+      const std::string& name = "")
+  {
+    // the kernel binary searches a flat table
+    std::uint64_t table_bytes = rt.size() * sizeof(RainbowTable::Entry);
+    cl::Buffer rt_buf;
+    stats.add_timing("time_upload_table", [&]() {
+      if (resident && !name.empty()) {
+        rt_buf = resident->get(name, rt);
+        table_bytes = std::max(table_bytes, resident->bytes());
+        return;
+      }
+      std::vector<RainbowTable::Entry> flat_buf;
+      rt_buf = cl.alloc<RainbowTable::Entry>(rt.size(), CL_MEM_READ_ONLY);
+      cl.write_sync(rt_buf, rt.flat(flat_buf), rt.size());
     });
-    cl.write_async(lookup_buf, lookup.data(), lookup.size());
 
-    auto result_buf = cl.alloc<std::uint64_t>(queries.size(), CL_MEM_WRITE_ONLY);
-    assert(queries.size() <= std::numeric_limits<uint32_t>::max());
-    fill_ulong(result_buf, (uint32_t)queries.size(), NOT_FOUND);
-    auto rt_buf = cl.alloc<RainbowTable::Entry>(rt.table.size(), CL_MEM_READ_ONLY);
-    cl.write_async(rt_buf, rt.table.data(), rt.table.size());
+    std::uint64_t batch = lookup_batch_size(work.size(), table_bytes);
+    std::uint64_t num_batches = (work.size() + batch - 1) / batch;
+    if (num_batches > 1 && !quiet)
+      std::cout << "Looking up " << num_batches << " batches of "
+        << batch << " queries" << std::endl;
+    int endpoint_bits = utils::bit_width(p.num_strings - 1);
+
+    cl::Buffer query_buf[2], lookup_buf[2], result_buf[2];
+    // join_done[b] fires when the results of set b are on the host and
+    // the set can be reused
+    std::vector<cl::Event> join_done(2);
+    bool used[2] = { false, false };
+    for (int b = 0; b < 2 && b < (int)num_batches; ++b) {
+      query_buf[b] = cl.alloc<Hash>(batch, CL_MEM_READ_ONLY);
+      lookup_buf[b] = cl.alloc<cl_ulong>(2 * p.chain_len * batch);
+      result_buf[b] = cl.alloc<std::uint64_t>(batch, CL_MEM_WRITE_ONLY);
+    }
 
-    kernel_lookup_endpoints.setArg(1, (cl_ulong)hi);
+    kernel_compute_endpoints.setArg(2, alphabet_buf);
     kernel_lookup_endpoints.setArg(2, alphabet_buf);
-    kernel_lookup_endpoints.setArg(3, query_buf);
-    kernel_lookup_endpoints.setArg(4, lookup_buf);
-    kernel_lookup_endpoints.setArg(5, result_buf);
     kernel_lookup_endpoints.setArg(6, rt_buf);
     kernel_lookup_endpoints.setArg(7, (cl_ulong)0);
-    kernel_lookup_endpoints.setArg(8, (cl_ulong)rt.table.size());
-    //kernel_lookup_endpoints.setArg(12, debug_buf);
+    kernel_lookup_endpoints.setArg(8, (cl_ulong)rt.size());
+
+    utils::Progress progress(work.size());
+    std::uint64_t first, last;
+    for (std::uint64_t k = 0; work.take(batch, first, last); ++k) {
+      if (!quiet)
+        progress.report(work.taken());
+      int b = k % 2;
+      std::uint64_t n = last - first;
+      stats.add("queries_looked_up", n);
+      std::uint64_t hi = p.chain_len * n;
+      if (used[b]) {
+        stats.add_timing("time_lookup_endpoints", [&]() {
+          join_done[b].wait();
+        });
+      }
+      used[b] = true;
+      cl.write_async(query_buf[b], queries.data() + first, n);
+      fill_ulong(result_buf[b], n, NOT_FOUND);
+
+      kernel_compute_endpoints.setArg(1, (cl_ulong)hi);
+      kernel_compute_endpoints.setArg(3, query_buf[b]);
+      kernel_compute_endpoints.setArg(4, (cl_int)n);
+      kernel_compute_endpoints.setArg(5, lookup_buf[b]);
+      for (uint64_t offset = 0; offset < hi; offset += clcfg.global_size) {
+        kernel_compute_endpoints.setArg(0, (cl_ulong)offset);
+        run(kernel_compute_endpoints,
+            std::min(uint64_t{clcfg.global_size}, hi - offset));
+      }
 
-    stats.add_timing("time_lookup_endpoints", [&]() {
-      utils::Progress progress(hi);
+      if (verify) {
+        stats.add_timing("time_verify", [&]() {
+          std::vector<std::array<std::uint64_t,2>> lookup(hi);
+          cl.read_sync(lookup_buf[b], lookup.data(), lookup.size());
+          for (std::uint64_t i = 0; i < hi; ++i) {
+            std::uint64_t start_iteration = i / n;
+            std::uint64_t query_idx = i % n;
+            assert(lookup[i][1] ==
+                (start_iteration << (64 - pos_bits()) | query_idx));
+            std::uint64_t endpoint = cpu.construct_chain(
+              queries[first + query_idx], start_iteration, p.chain_len).first;
+            assert(lookup[i][0] == endpoint);
+          }
+        });
+      }
+
+      // sorting by endpoint makes the binary searches of neighbouring work
+      // items touch the same parts of the table
+      ocl_primitives::radix_sort(cl, clcfg, lookup_buf[b],
+          2 * sizeof(cl_ulong), hi, endpoint_bits, "ulong2", "x.x");
+
+      kernel_lookup_endpoints.setArg(1, (cl_ulong)hi);
+      kernel_lookup_endpoints.setArg(3, query_buf[b]);
+      kernel_lookup_endpoints.setArg(4, lookup_buf[b]);
+      kernel_lookup_endpoints.setArg(5, result_buf[b]);
       for (uint64_t offset = 0; offset < hi; offset += clcfg.global_size) {
-        progress.report(offset);
         kernel_lookup_endpoints.setArg(0, (cl_ulong)offset);
-
-        size_t count = std::min(uint64_t{clcfg.global_size}, hi - offset);
-
-        /*
-        std::array<std::uint64_t, 4> first, last;
-        cl.read_sync(lookup_buf, &first, 1, offset);
-        cl.read_sync(lookup_buf, &last, 1, offset + count - 1);
-        auto lo = std::lower_bound(std::begin(rt.table), std::end(rt.table),
-            std::make_pair(first[0], std::uint64_t{0}));
-        auto hi = std::upper_bound(std::begin(rt.table), std::end(rt.table),
-            std::make_pair(last[0], std::numeric_limits<std::uint64_t>::max()));
-        //std::cout << (lo - std::begin(rt.table)) << " - ";
-        //std::cout << (hi - std::begin(rt.table)) << std::endl;
-        kernel_lookup_endpoints.setArg(11, (cl_ulong)(lo - std::begin(rt.table)));
-        kernel_lookup_endpoints.setArg(12, (cl_ulong)(hi - std::begin(rt.table)));
-        */
-
-        run(kernel_lookup_endpoints, count);
+        run(kernel_lookup_endpoints,
+            std::min(uint64_t{clcfg.global_size}, hi - offset));
+      }
+      cl.read_after(result_buf[b], res.data() + first, n, join_done[b]);
+      cl.flush_queue();
+      if (throttle) {
         // responsiveness
         cl.finish_queue();
         usleep(1000);
       }
-      progress.finish();
-    });
-
-    //assert(std::is_sorted(std::begin(rt.table),std::end(rt.table)));
-    std::vector<std::uint64_t> res(queries.size());
-    cl.read_sync(result_buf, res.data(), res.size());
-    if (verify) {
-      stats.add_timing("time_verify", [&]() {
-        for (std::uint64_t i = 0; i < queries.size(); ++i) {
-          std::uint64_t cmp = cpu.lookup_single(rt, queries[i]);
-          assert(cmp == res[i]);
-        }
-      });
     }
-    return res;
+    stats.add_timing("time_lookup_endpoints", [&]() {
+      cl.finish_queue();
+    });
+    if (!quiet)
+      progress.finish();
   }
 };
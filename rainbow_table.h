@@ -1,21 +1,61 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compressed_table.h"
+
+// How reduce() maps a hash to a string index. Tables record the variant
+// they were built with, so that old tables keep working.
+enum Reduction : std::uint64_t {
+  // x % num_strings
+  REDUCE_MODULO = 0,
+  // (x * num_strings) >> 64, which avoids the 64-bit division. This only
+  // looks at the high bits of x, so x is first multiplied by an odd
+  // constant to carry the round number from the low bits up there.
+  REDUCE_FASTRANGE = 1,
+};
+
+// On-disk layout of the table file
+enum TableFormat : std::uint64_t {
+  // sorted array of (endpoint, start) pairs
+  TABLE_RAW = 0,
+  // see CompressedTable
+  TABLE_COMPRESSED = 1,
+};
+
 struct RainbowTableParams {
   std::string alphabet;
   std::uint64_t num_strings, chain_len, table_index, num_start_values;
+  std::uint64_t reduction = REDUCE_FASTRANGE;
+  std::uint64_t table_format = TABLE_RAW;
+
+  // length of the longest string covered by the table
+  std::uint64_t max_string_len() const {
+    std::uint64_t len = 0, offset = 1, num = 1;
+    while (offset < num_strings) {
+      num *= alphabet.size();
+      offset += num;
+      len++;
+    }
+    return len;
+  }
 
   void save_to_disk(std::string filename) {
     std::ofstream pf(filename);
     pf << alphabet.size() << " ";
     pf.write(alphabet.c_str(), alphabet.size());
     pf << " " << num_strings << " " << chain_len << " " << table_index
-      << " " << num_start_values;
+      << " " << num_start_values << " " << reduction << " " << table_format;
   }
 
   void read_from_disk(std::string filename) {
@@ -32,19 +72,94 @@ struct RainbowTableParams {
     pf.ignore();
     pf >> num_strings >> chain_len >> table_index >> num_start_values;
     assert(pf);
+    // tables from before the reduction was versioned use the modulo
+    if (!(pf >> reduction))
+      reduction = REDUCE_MODULO;
+    assert(reduction == REDUCE_MODULO || reduction == REDUCE_FASTRANGE);
+    if (!(pf >> table_format))
+      table_format = TABLE_RAW;
+    assert(table_format == TABLE_RAW || table_format == TABLE_COMPRESSED);
+  }
+
+  std::string reduction_name() const {
+    return reduction == REDUCE_MODULO ? "modulo" : "fastrange";
   }
 };
 
 struct RainbowTable {
   using Entry = std::pair<std::uint64_t, std::uint64_t>;
+  // the table while it is built or after read_from_disk. Lookups should go
+  // through find() or data()/size(), which also cover mapped tables.
   std::vector<Entry> table;
+  // used instead of the above after read_compressed
+  CompressedTable compressed;
+
+  RainbowTable() { }
+  RainbowTable(const RainbowTable&) = delete;
+  RainbowTable& operator=(const RainbowTable&) = delete;
+
+  ~RainbowTable() {
+    unmap();
+  }
+
+  bool is_compressed() const { return use_compressed; }
+
+  // data() is only valid for uncompressed tables
+  const Entry* data() const {
+    assert(!use_compressed);
+    return mapping ? mapping : table.data();
+  }
+  std::size_t size() const {
+    if (use_compressed)
+      return compressed.size();
+    return mapping ? mapping_size : table.size();
+  }
+  const Entry* begin() const { return data(); }
+  const Entry* end() const { return data() + size(); }
+
+  // Finds the start of the chain ending in endpoint. Tables contain every
+  // endpoint at most once.
+  bool find(std::uint64_t endpoint, std::uint64_t& start) const {
+    if (use_compressed)
+      return compressed.find(endpoint, start);
+    auto it = std::lower_bound(begin(), end(),
+        std::make_pair(endpoint, std::uint64_t{0}));
+    if (it == end() || it->first != endpoint)
+      return false;
+    start = it->second;
+    return true;
+  }
+
+  // The table as a flat array, for code that cannot work on the compressed
+  // form. Decompresses into buf if necessary.
+  const Entry* flat(std::vector<Entry>& buf) const {
+    if (!use_compressed)
+      return data();
+    buf = compressed.decompress();
+    return buf.data();
+  }
 
   void save_to_disk(std::string filename) {
     std::ofstream f(filename);
-    f.write((char*)&table[0], table.size() * sizeof table[0]);
+    f.write((char*)data(), size() * sizeof(Entry));
+  }
+
+  void save_compressed(std::string filename, const RainbowTableParams& p) {
+    CompressedTable ct;
+    ct.build(data(), size(), p.num_strings, p.table_index * p.num_start_values);
+    ct.save_to_disk(filename);
+  }
+
+  void read_compressed(std::string filename) {
+    unmap();
+    table.clear();
+    compressed.read_from_disk(filename);
+    use_compressed = true;
   }
 
   void read_from_disk(std::string filename) {
+    unmap();
+    use_compressed = false;
     std::ifstream f(filename);
     f.seekg(0, std::ios::end);
     std::size_t num = f.tellg() / sizeof(Entry);
@@ -52,6 +167,52 @@ struct RainbowTable {
     f.seekg(0, std::ios::beg);
     f.read((char*)&table[0], num * sizeof table[0]);
   }
+
+  // Maps the table file instead of reading it, which takes constant time
+  // and shares the page cache with other processes using the same table.
+  // populate prefaults the whole file, huge_pages asks for transparent huge
+  // pages and sequential tells the kernel we are going to stream over the
+  // table rather than binary search in it.
+  void map_from_disk(std::string filename,
+      bool populate = false, bool huge_pages = false, bool sequential = false)
+  {
+    unmap();
+    table.clear();
+    use_compressed = false;
+    int fd = open(filename.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    int res = fstat(fd, &st);
+    assert(res == 0);
+    std::size_t num = st.st_size / sizeof(Entry);
+    if (num) {
+      mapping_bytes = num * sizeof(Entry);
+      void* m = mmap(nullptr, mapping_bytes, PROT_READ,
+          MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+      assert(m != MAP_FAILED);
+      madvise(m, mapping_bytes, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+#ifdef MADV_HUGEPAGE
+      if (huge_pages)
+        madvise(m, mapping_bytes, MADV_HUGEPAGE);
+#endif
+      mapping = (const Entry*)m;
+      mapping_size = num;
+    }
+    close(fd);
+  }
+
+private:
+  bool use_compressed = false;
+  const Entry* mapping = nullptr;
+  std::size_t mapping_size = 0, mapping_bytes = 0;
+
+  void unmap() {
+    if (mapping)
+      munmap((void*)mapping, mapping_bytes);
+    mapping = nullptr;
+    mapping_size = mapping_bytes = 0;
+  }
 };
 
 const std::uint64_t NOT_FOUND = -1;
+const std::uint64_t REDUCE_MIX = 0x9e3779b97f4a7c15;
@@ -1,20 +1,22 @@
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <unordered_set>
 
-#if !HAVE_OPENCL
-#  error "Need OpenCL"
-#endif
 #include "opencl.h"
 #include "hash.h"
 #include "rainbow_table.h"
 #include "rainbow_cpu.h"
-#include "rainbow_gpu.h"
-#include "bitonic_sort.h"
-#include "scan.h"
-#include "filter.h"
+#include "run_merge.h"
+#if HAVE_OPENCL
+#  include "rainbow_gpu.h"
+#  include "device_pool.h"
+#  include "bitonic_sort.h"
+#  include "scan.h"
+#  include "filter.h"
+#endif
 #include "utils.h"
 
 using namespace std;
@@ -40,7 +42,23 @@ void usage(char *argv0) {
        << "           for coverage analysis. 0 means no coverage is measured" << endl
        << "  -i INT   Table index in case multiple tables are generated" << endl
        << "  -r INT   Specify random seed (defaults to constant value)" << endl
+       << "  -j INT   Number of CPU threads (defaults to number of cores)" << endl
+       << "  -m       CPU only: sort the table in place, which needs less" << endl
+       << "           memory but is slower" << endl
+       << "  -c       Write the table in the compressed format, which needs" << endl
+       << "           about a third of the space" << endl
        << "  -v       OpenCL only: Verify results using CPU implementation" << endl
+       << "  -D       OpenCL only: use all OpenCL devices, including CPU" << endl
+       << "           runtimes, which take chunks as they finish their last one," << endl
+       << "           so faster devices do more of the work" << endl
+       << "  -C       OpenCL only: also generate chains on the CPU threads," << endl
+       << "           which take chunks from the same queue as the devices." << endl
+       << "           The CPU gets the threads of -j beyond one per device" << endl
+       << "  -w       OpenCL only: wait for the GPU after every batch of chunks," << endl
+       << "           which keeps a display on the same GPU responsive" << endl
+       << "  -d INT   OpenCL only: build out of core, writing sorted runs of up" << endl
+       << "           to INT million chains next to outfile and merging them" << endl
+       << "           at the end, so that the table need not fit on the device" << endl
        << "  -b INT   OpenCL only: block size" << endl
        << "  -l INT   OpenCL only: local group size" << endl
        << "  -g INT   OpenCL only: global group size" << endl
@@ -52,13 +70,17 @@ void usage(char *argv0) {
 
 
 uint64_t max_string_len;
-bool use_opencl = false, verify = false;
+bool use_opencl = false, verify = false, inplace_sort = false;
+bool compress = false, throttle = false, all_devices = false;
+bool hybrid = false;
 double alpha = 0.01;
 uint64_t samples = 0;
 uint64_t seed = 0;
 RainbowTableParams params;
 string outfile;
 uint64_t block_size = 1;
+unsigned num_threads = utils::default_num_threads();
+uint64_t run_millions = 0;
 OpenCLConfig clcfg { 1<<17, 1<<8 };
 
 const int default_chain_len = 1000;
@@ -80,6 +102,10 @@ void parse_opts(int argc, char *argv[]) {
       continue;
     }
     if (o == "-o") {
+      if (!HAVE_OPENCL) {
+        cerr << "ERROR: this build has no OpenCL support" << endl;
+        usage(argv[0]);
+      }
       use_opencl = true;
       continue;
     }
@@ -87,6 +113,26 @@ void parse_opts(int argc, char *argv[]) {
       verify = true;
       continue;
     }
+    if (o == "-m") {
+      inplace_sort = true;
+      continue;
+    }
+    if (o == "-c") {
+      compress = true;
+      continue;
+    }
+    if (o == "-w") {
+      throttle = true;
+      continue;
+    }
+    if (o == "-D") {
+      all_devices = true;
+      continue;
+    }
+    if (o == "-C") {
+      hybrid = true;
+      continue;
+    }
     // 1 params
     if (o == "-a") {
       if (i + 1 < argc) {
@@ -146,6 +192,18 @@ void parse_opts(int argc, char *argv[]) {
       ++i;
       continue;
     }
+    if (o == "-j") {
+      if (i + 1 < argc) {
+        if (!(stringstream(argv[i+1]) >> num_threads) || num_threads == 0) {
+          cerr << "ERROR: thread count should be an integer > 0" << endl;
+          usage(argv[0]);
+        }
+      } else {
+        usage(argv[0]);
+      }
+      ++i;
+      continue;
+    }
     if (o == "-l") {
       if (i + 1 < argc) {
         if (!(stringstream(argv[i+1]) >> clcfg.local_size)) {
@@ -168,6 +226,18 @@ void parse_opts(int argc, char *argv[]) {
       ++i;
       continue;
     }
+    if (o == "-d") {
+      if (i + 1 < argc) {
+        if (!(stringstream(argv[i+1]) >> run_millions) || run_millions == 0) {
+          cerr << "ERROR: run size must be an integer > 0" << endl;
+          usage(argv[0]);
+        }
+      } else {
+        usage(argv[0]);
+      }
+      ++i;
+      continue;
+    }
     if (o == "-b") {
       if (i + 1 < argc) {
         if (!(stringstream(argv[i+1]) >> block_size)) {
@@ -222,12 +292,19 @@ int main_(int argc, char* argv[]) {
   cout << "  alpha       = " << alpha << endl;
   cout << "  t           = " << params.chain_len << endl;
   cout << "  table_index = " << params.table_index << endl;
+  cout << "  reduction   = " << params.reduction_name() << endl;
+  cout << "  compressed  = " << (compress?"yes":"no") << endl;
   cout << "  rand seed   = " << seed << endl;
   if (samples)
     cout << "  cov samples = " << samples << endl;
+  cout << "  threads     = " << num_threads << endl;
   cout << "  use OpenCL  = " << (use_opencl?"yes":"no") << endl;
   if (use_opencl) {
     cout << "  verify      = " << (verify?"yes":"no") << endl;
+    cout << "  throttle    = " << (throttle?"yes":"no") << endl;
+    cout << "  hybrid      = " << (hybrid?"yes":"no") << endl;
+    if (run_millions)
+      cout << "  run size    = " << run_millions << "M chains" << endl;
     cout << "  block size  = " << block_size << endl;
     cout << "  local size  = " << clcfg.local_size << endl;
     cout << "  global size = " << clcfg.global_size << endl;
@@ -242,22 +319,81 @@ int main_(int argc, char* argv[]) {
 
   RainbowTable rt;
   utils::Stats stats;
-  CPUImplementation cpu(params, stats);
-  OpenCLApp cl;
-  GPUImplementation gpu(params, cl, cpu, stats, verify, clcfg, block_size);
-  if (use_opencl) {
-    cl.print_cl_info();
+  CPUImplementation cpu(params, stats, num_threads);
+  cpu.inplace_sort = inplace_sort;
+#if HAVE_OPENCL
+  // CPU runs never touch the OpenCL driver
+  unique_ptr<OpenCLApp> cl;
+  unique_ptr<GPUImplementation> gpu;
+  vector<unique_ptr<OpenCLApp>> cl_apps;
+  unique_ptr<DevicePool> pool;
+  if (use_opencl && (all_devices || hybrid)) {
+    if (all_devices) {
+      cl_apps = DevicePool::open_all();
+    } else {
+      cl_apps.emplace_back(new OpenCLApp);
+      cl_apps.back()->print_cl_info();
+    }
+    pool.reset(new DevicePool(params, cl_apps, cpu, stats, verify, clcfg,
+          block_size));
+    // every device has a host thread waiting on its queue, the CPU only
+    // gets the threads left over
+    if (hybrid && num_threads > pool->size())
+      pool->host_threads = num_threads - pool->size();
+    else if (hybrid)
+      cout << "NOTE: all " << num_threads << " threads drive a device"
+           << " queue, -C has no effect" << endl;
+    pool->configure([](GPUImplementation& gpu, size_t i) {
+      gpu.throttle = throttle;
+      gpu.run_size = run_millions * 1000000;
+      gpu.run_prefix = outfile + ".dev" + to_string(i) + ".run";
+    });
+  } else if (use_opencl) {
+    cl.reset(new OpenCLApp);
+    cl->print_cl_info();
+    gpu.reset(new GPUImplementation(
+          params, *cl, cpu, stats, verify, clcfg, block_size));
+    gpu->throttle = throttle;
+    gpu->run_size = run_millions * 1000000;
+    gpu->run_prefix = outfile + ".run";
   }
-
-  if (use_opencl)
-    gpu.build(rt);
+  if (pool)
+    pool->build(rt);
+  else if (gpu)
+    gpu->build(rt);
   else
+#endif
     cpu.build(rt);
+  // out-of-core builds merge their runs straight into the table file, or
+  // into a temporary one that is compressed afterwards
+  bool out_of_core = use_opencl && run_millions;
+  string merged_file = compress ? outfile + ".merged" : outfile;
+#if HAVE_OPENCL
+  if (out_of_core) {
+    const vector<string>& runs = pool ? pool->runs : gpu->runs;
+    cout << "Merging " << runs.size() << " runs into " << merged_file << endl;
+    stats.add_timing("time_merge_runs", [&]() {
+      cpu_primitives::merge_unique_runs(runs, merged_file, num_threads);
+    });
+    for (auto& run : runs)
+      unlink(run.c_str());
+    rt.map_from_disk(merged_file, false, false, false);
+  }
+#endif
+  auto lookup = [&](const vector<Hash>& queries) -> vector<uint64_t> {
+#if HAVE_OPENCL
+    if (pool)
+      return pool->lookup(rt, queries);
+    if (gpu)
+      return gpu->lookup(rt, queries);
+#endif
+    return cpu.lookup(rt, queries);
+  };
 
   //ocl_primitives::test_filter(cl, clcfg); return 0;
   cout << setprecision(4);
-  cout << "Result: " << rt.table.size() << " unique chains (~"
-       << (100. * rt.table.size() / params.num_strings)
+  cout << "Result: " << rt.size() << " unique chains (~"
+       << (100. * rt.size() / params.num_strings)
        << "% of search space)" << endl;
 
   if (samples) {
@@ -272,7 +408,7 @@ int main_(int argc, char* argv[]) {
         cpu.compute_hash(sample, h);
         queries.push_back(h);
       }
-      for (auto x: use_opencl ? gpu.lookup(rt, queries) : cpu.lookup(rt, queries))
+      for (auto x: lookup(queries))
         found += x != NOT_FOUND;
     });
     cout << setprecision(4);
@@ -282,9 +418,15 @@ int main_(int argc, char* argv[]) {
   cout << "Writing table to disk" << endl;
   stats.add_timing("time_write_table", [&]() {
     cout << "  " << outfile + ".params" << endl;
+    params.table_format = compress ? TABLE_COMPRESSED : TABLE_RAW;
     params.save_to_disk(outfile + ".params");
     cout << "  " << outfile << endl;
-    rt.save_to_disk(outfile);
+    if (compress)
+      rt.save_compressed(outfile, params);
+    else if (!out_of_core)
+      rt.save_to_disk(outfile);
+    if (compress && out_of_core)
+      unlink(merged_file.c_str());
   });
 
   cout << "STATS" << endl;
@@ -298,10 +440,14 @@ int main_(int argc, char* argv[]) {
 }
 
 int main(int argc, char** argv) {
+#if HAVE_OPENCL
   try {
     return main_(argc, argv);
   } catch (cl::Error err) {
     cerr << "OpenCL exception: " << err.what() << " (" << err.err() << ")" << endl;
     return EXIT_FAILURE;
   }
+#else
+  return main_(argc, argv);
+#endif
 }
@@ -1,17 +1,18 @@
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <unordered_set>
 
-#if !HAVE_OPENCL
-#  error "Need OpenCL"
-#endif
 #include "opencl.h"
 #include "hash.h"
 #include "rainbow_table.h"
 #include "rainbow_cpu.h"
-#include "rainbow_gpu.h"
+#if HAVE_OPENCL
+#  include "rainbow_gpu.h"
+#  include "device_pool.h"
+#endif
 #include "utils.h"
 
 using namespace std;
@@ -29,6 +30,18 @@ void usage(char *argv0) {
        << "  -o         Use OpenCL to accelerate the lookup" << endl
        << "  -v         Verify results with CPU" << endl
        << "  -r INT     Specify random seed (defaults to constant value)" << endl
+       << "  -j INT     Number of CPU threads (defaults to number of cores)" << endl
+       << "  -B INT     CPU only: join queries against the table in batches" << endl
+       << "             of this size instead of searching for each endpoint" << endl
+       << "  -P         Prefault the memory-mapped table files" << endl
+       << "  -T         Back the memory-mapped table files with huge pages" << endl
+       << "  -M INT     OpenCL only: device memory per query batch in MiB" << endl
+       << "             (defaults to what the device has free)" << endl
+       << "  -D         OpenCL only: use all OpenCL devices, including CPU" << endl
+       << "             runtimes, which take batches as they finish their" << endl
+       << "             last one, so faster devices do more of the work" << endl
+       << "  -w         OpenCL only: wait for the GPU after every batch, which" << endl
+       << "             keeps a display on the same GPU responsive" << endl
        << "  -l INT     OpenCL only: local group size" << endl
        << "  -g INT     OpenCL only: global group size" << endl
        << "  -b INT     OpenCL only: block size" << endl
@@ -39,7 +52,8 @@ void usage(char *argv0) {
   exit(EXIT_FAILURE);
 }
 
-bool use_opencl = false, verify = false;
+bool use_opencl = false, verify = false, populate = false, huge_pages = false;
+bool throttle = false, all_devices = false;
 string infile;
 vector<string> table_files;
 Hash hash_value;
@@ -47,6 +61,9 @@ uint32_t block_size = 1;
 OpenCLConfig clcfg { 1<<17, 1<<8 };
 uint64_t seed = 0;
 uint32_t samples = 0;
+unsigned num_threads = utils::default_num_threads();
+uint64_t batch_size = 0;
+uint64_t batch_memory_mib = 0;
 
 void parse_opts(int argc, char *argv[]) {
   int pos = 0;
@@ -59,6 +76,10 @@ void parse_opts(int argc, char *argv[]) {
       continue;
     }
     if (o == "-o") {
+      if (!HAVE_OPENCL) {
+        cerr << "ERROR: this build has no OpenCL support" << endl;
+        usage(argv[0]);
+      }
       use_opencl = true;
       continue;
     }
@@ -66,6 +87,22 @@ void parse_opts(int argc, char *argv[]) {
       verify = true;
       continue;
     }
+    if (o == "-P") {
+      populate = true;
+      continue;
+    }
+    if (o == "-T") {
+      huge_pages = true;
+      continue;
+    }
+    if (o == "-w") {
+      throttle = true;
+      continue;
+    }
+    if (o == "-D") {
+      all_devices = true;
+      continue;
+    }
     // 1 params
     if (o == "-f") {
       options++;
@@ -105,6 +142,42 @@ void parse_opts(int argc, char *argv[]) {
       ++i;
       continue;
     }
+    if (o == "-j") {
+      if (i + 1 < argc) {
+        if (!(stringstream(argv[i+1]) >> num_threads) || num_threads == 0) {
+          cerr << "ERROR: thread count must be an integer > 0" << endl;
+          usage(argv[0]);
+        }
+      } else {
+        usage(argv[0]);
+      }
+      ++i;
+      continue;
+    }
+    if (o == "-B") {
+      if (i + 1 < argc) {
+        if (!(stringstream(argv[i+1]) >> batch_size) || batch_size == 0) {
+          cerr << "ERROR: batch size must be an integer > 0" << endl;
+          usage(argv[0]);
+        }
+      } else {
+        usage(argv[0]);
+      }
+      ++i;
+      continue;
+    }
+    if (o == "-M") {
+      if (i + 1 < argc) {
+        if (!(stringstream(argv[i+1]) >> batch_memory_mib) || batch_memory_mib == 0) {
+          cerr << "ERROR: batch memory must be an integer > 0" << endl;
+          usage(argv[0]);
+        }
+      } else {
+        usage(argv[0]);
+      }
+      ++i;
+      continue;
+    }
     if (o == "-l") {
       if (i + 1 < argc) {
         if (!(stringstream(argv[i+1]) >> clcfg.local_size)) {
@@ -162,9 +235,30 @@ void parse_opts(int argc, char *argv[]) {
     usage(argv[0]);
 }
 
+#if HAVE_OPENCL
+// created on first use, so that CPU runs never touch the OpenCL driver
+unique_ptr<OpenCLApp> cl_app;
+
+OpenCLApp& get_cl() {
+  if (!cl_app) {
+    cl_app.reset(new OpenCLApp);
+    cl_app->print_cl_info();
+  }
+  return *cl_app;
+}
+
+// the same for all devices, with -D
+vector<unique_ptr<OpenCLApp>> cl_apps;
+
+const vector<unique_ptr<OpenCLApp>>& get_all_cl() {
+  if (cl_apps.empty())
+    cl_apps = DevicePool::open_all();
+  return cl_apps;
+}
+#endif
+
 vector<uint64_t> lookup_any(
-    RainbowTableParams& first_params,
-    OpenCLApp& cl, utils::Stats& stats,
+    RainbowTableParams& first_params, utils::Stats& stats,
     vector<Hash> queries) {
   vector<uint64_t> all_results(queries.size(), NOT_FOUND);
   vector<size_t> indices;
@@ -189,9 +283,17 @@ vector<uint64_t> lookup_any(
     cout << "  num_strings = " << params.num_strings << endl;
     cout << "  t           = " << params.chain_len << endl;
     cout << "  table_index = " << params.table_index << endl;
+    cout << "  reduction   = " << params.reduction_name() << endl;
+    cout << "  compressed  = "
+        << (params.table_format == TABLE_COMPRESSED?"yes":"no") << endl;
+    cout << "  threads     = " << num_threads << endl;
+    if (!use_opencl && batch_size)
+      cout << "  batch size  = " << batch_size << endl;
     cout << "  use OpenCL  = " << (use_opencl?"yes":"no") << endl;
     if (use_opencl) {
       cout << "  verify      = " << (verify?"yes":"no") << endl;
+      if (batch_memory_mib)
+        cout << "  batch mem   = " << batch_memory_mib << " MiB" << endl;
       cout << "  block size  = " << block_size << endl;
       cout << "  local size  = " << clcfg.local_size << endl;
       cout << "  global size = " << clcfg.global_size << endl;
@@ -199,16 +301,50 @@ vector<uint64_t> lookup_any(
 
     RainbowTable rt;
     stats.add_timing("time_read_table", [&]() {
-      cout << "Reading table from file " << table_file << endl;
-      rt.read_from_disk(table_file);
+      if (params.table_format == TABLE_COMPRESSED) {
+        cout << "Reading compressed table from file " << table_file << endl;
+        rt.read_compressed(table_file);
+        return;
+      }
+      cout << "Mapping table from file " << table_file << endl;
+      // the batched CPU lookup streams over the table, everything else
+      // binary searches in it
+      rt.map_from_disk(table_file, populate, huge_pages,
+          !use_opencl && batch_size);
     });
 
-    CPUImplementation cpu(params, stats);
-    GPUImplementation gpu(params, cl, cpu, stats, verify, clcfg, block_size);
+    CPUImplementation cpu(params, stats, num_threads, batch_size);
+#if HAVE_OPENCL
+    unique_ptr<GPUImplementation> gpu;
+    unique_ptr<DevicePool> pool;
+    if (use_opencl && all_devices) {
+      pool.reset(new DevicePool(params, get_all_cl(), cpu, stats, verify,
+            clcfg, block_size));
+      pool->configure([](GPUImplementation& gpu, size_t) {
+        gpu.throttle = throttle;
+        gpu.batch_memory = batch_memory_mib << 20;
+      });
+    } else if (use_opencl) {
+      gpu.reset(new GPUImplementation(
+            params, get_cl(), cpu, stats, verify, clcfg, block_size));
+      gpu->throttle = throttle;
+      gpu->batch_memory = batch_memory_mib << 20;
+    }
+#endif
 
     vector<uint64_t> results;
     stats.add_timing("time_lookup", [&]() {
-      results = use_opencl ? gpu.lookup(rt, queries) : cpu.lookup(rt, queries);
+#if HAVE_OPENCL
+      if (pool) {
+        results = pool->lookup(rt, queries, table_file);
+        return;
+      }
+      if (gpu) {
+        results = gpu->lookup(rt, queries, table_file);
+        return;
+      }
+#endif
+      results = cpu.lookup(rt, queries);
     });
     assert(queries.size() == results.size());
     vector<Hash> new_queries;
@@ -237,13 +373,9 @@ int main_(int argc, char* argv[]) {
   parse_opts(argc, argv);
   utils::Stats stats;
 
-  OpenCLApp cl;
-  if (use_opencl)
-    cl.print_cl_info();
-
   RainbowTableParams params;
   params.read_from_disk(table_files[0] + ".params");
-  CPUImplementation cpu(params, stats);
+  CPUImplementation cpu(params, stats, num_threads, batch_size);
 
   if (samples) {
     uint64_t found = 0;
@@ -257,7 +389,7 @@ int main_(int argc, char* argv[]) {
         cpu.compute_hash(sample, h);
         queries.push_back(h);
       }
-      for (auto x: lookup_any(params, cl, stats, queries))
+      for (auto x: lookup_any(params, stats, queries))
         found += x != NOT_FOUND;
     });
   } else {
@@ -277,7 +409,7 @@ int main_(int argc, char* argv[]) {
     } else {
       queries.push_back(hash_value);
     }
-    vector<uint64_t> results = lookup_any(params, cl, stats, queries);
+    vector<uint64_t> results = lookup_any(params, stats, queries);
     assert(results.size() == queries.size());
     for (size_t i = 0; i < results.size(); ++i) {
       print_hash(queries[i]);
@@ -298,10 +430,14 @@ int main_(int argc, char* argv[]) {
 }
 
 int main(int argc, char** argv) {
+#if HAVE_OPENCL
   try {
     return main_(argc, argv);
   } catch (cl::Error err) {
     cerr << "OpenCL exception: " << err.what() << " (" << err.err() << ")" << endl;
     return EXIT_FAILURE;
   }
+#else
+  return main_(argc, argv);
+#endif
 }
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rainbow_table.h"
+#include "utils.h"
+
+namespace cpu_primitives {
+  namespace detail {
+    using Entry = RainbowTable::Entry;
+    // entries per write of a merge part
+    const std::size_t MERGE_BLOCK = 1 << 16;
+
+    struct Span {
+      const Entry* data;
+      std::uint64_t size;
+    };
+
+    // Merges spans[r][lo[r], hi[r]) for all r and calls emit for the first
+    // entry of every endpoint. On equal endpoints the smallest start wins,
+    // like in the compaction of a single build.
+    template <typename F>
+    void merge_part(const std::vector<Span>& spans,
+        const std::vector<std::uint64_t>& lo,
+        const std::vector<std::uint64_t>& hi, F emit)
+    {
+      using Head = std::tuple<Entry, std::size_t, std::uint64_t>;
+      std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+      for (std::size_t r = 0; r < spans.size(); ++r)
+        if (lo[r] < hi[r])
+          heads.emplace(spans[r].data[lo[r]], r, lo[r]);
+      bool any = false;
+      std::uint64_t last = 0;
+      while (!heads.empty()) {
+        Entry e;
+        std::size_t r;
+        std::uint64_t i;
+        std::tie(e, r, i) = heads.top();
+        heads.pop();
+        if (!any || e.first != last)
+          emit(e);
+        any = true;
+        last = e.first;
+        if (++i < hi[r])
+          heads.emplace(spans[r].data[i], r, i);
+      }
+    }
+
+    // Merges the spans, each sorted by endpoint without duplicates, keeping
+    // every endpoint once. The endpoint range is split into parts of
+    // roughly equal size, which are merged on their own threads: a first
+    // pass counts the unique entries of every part, then alloc(total) is
+    // called, and a second pass calls write(pos, entries, n) to store them
+    // at their final position. Returns the number of entries.
+    template <typename A, typename W>
+    std::uint64_t merge_unique(const std::vector<Span>& spans,
+        unsigned num_threads, A alloc, W write)
+    {
+      std::uint64_t total = 0;
+      for (auto& span : spans)
+        total += span.size;
+
+      // split at endpoints sampled evenly from all spans
+      unsigned parts = std::max(std::uint64_t{1}, std::min(
+            std::uint64_t{num_threads} * 4, total / MERGE_BLOCK));
+      std::vector<std::uint64_t> samples;
+      for (auto& span : spans)
+        for (std::uint64_t k = 1; k < parts; ++k)
+          if (span.size)
+            samples.push_back(span.data[k * span.size / parts].first);
+      std::sort(samples.begin(), samples.end());
+      std::vector<std::uint64_t> splitters;
+      for (std::uint64_t k = 1; k < parts && !samples.empty(); ++k)
+        splitters.push_back(samples[k * samples.size() / parts]);
+      splitters.erase(std::unique(splitters.begin(), splitters.end()),
+          splitters.end());
+      parts = splitters.size() + 1;
+
+      // bounds[p][r] is where part p starts in span r
+      std::vector<std::vector<std::uint64_t>> bounds(parts + 1,
+          std::vector<std::uint64_t>(spans.size()));
+      for (std::size_t r = 0; r < spans.size(); ++r) {
+        const Entry* begin = spans[r].data;
+        const Entry* end = begin + spans[r].size;
+        for (unsigned p = 1; p < parts; ++p)
+          bounds[p][r] = std::lower_bound(begin, end,
+              std::make_pair(splitters[p - 1], std::uint64_t{0})) - begin;
+        bounds[parts][r] = spans[r].size;
+      }
+
+      std::vector<std::uint64_t> offset(parts + 1);
+      utils::parallel_for(num_threads, 0, parts, 1,
+          [&](unsigned, std::uint64_t p, std::uint64_t) {
+            std::uint64_t count = 0;
+            merge_part(spans, bounds[p], bounds[p + 1],
+                [&](const Entry&) { count++; });
+            offset[p + 1] = count;
+          });
+      for (unsigned p = 0; p < parts; ++p)
+        offset[p + 1] += offset[p];
+      std::uint64_t unique = offset[parts];
+
+      alloc(unique);
+      utils::parallel_for(num_threads, 0, parts, 1,
+          [&](unsigned, std::uint64_t p, std::uint64_t) {
+            std::vector<Entry> block;
+            block.reserve(MERGE_BLOCK);
+            std::uint64_t pos = offset[p];
+            auto flush = [&]() {
+              write(pos, block.data(), block.size());
+              pos += block.size();
+              block.clear();
+            };
+            merge_part(spans, bounds[p], bounds[p + 1],
+                [&](const Entry& e) {
+                  block.push_back(e);
+                  if (block.size() == MERGE_BLOCK)
+                    flush();
+                });
+            flush();
+          });
+      return unique;
+    }
+  }
+
+  // Merges the run files, each sorted by endpoint without duplicates, into
+  // one table file that keeps every endpoint once. Returns the number of
+  // entries.
+  std::uint64_t merge_unique_runs(const std::vector<std::string>& files,
+      const std::string& outfile, unsigned num_threads)
+  {
+    using detail::Entry;
+    std::vector<std::unique_ptr<RainbowTable>> runs;
+    std::vector<detail::Span> spans;
+    for (auto& file : files) {
+      runs.emplace_back(new RainbowTable);
+      runs.back()->map_from_disk(file, false, false, true);
+      spans.push_back(detail::Span { runs.back()->data(), runs.back()->size() });
+    }
+    int fd = open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    std::uint64_t unique = detail::merge_unique(spans, num_threads,
+        [&](std::uint64_t n) {
+          int res = ftruncate(fd, n * sizeof(Entry));
+          assert(res == 0);
+        },
+        [&](std::uint64_t pos, const Entry* entries, std::size_t n) {
+          std::size_t bytes = n * sizeof(Entry);
+          ssize_t written = pwrite(fd, entries, bytes, pos * sizeof(Entry));
+          assert(written == (ssize_t)bytes);
+        });
+    close(fd);
+    return unique;
+  }
+
+  // The same for tables in memory, the result replaces out
+  void merge_unique_tables(const std::vector<const RainbowTable*>& tables,
+      std::vector<RainbowTable::Entry>& out, unsigned num_threads)
+  {
+    using detail::Entry;
+    std::vector<detail::Span> spans;
+    for (auto table : tables)
+      spans.push_back(detail::Span { table->data(), table->size() });
+    detail::merge_unique(spans, num_threads,
+        [&](std::uint64_t n) {
+          out.clear();
+          out.resize(n);
+        },
+        [&](std::uint64_t pos, const Entry* entries, std::size_t n) {
+          std::copy(entries, entries + n, out.begin() + pos);
+        });
+  }
+}
@@ -1,9 +1,11 @@
 #line 2 "scan.cl"
+// IDX is the index type, base the global id of the first work item of the
+// launch (see OpenCLApp::run_kernel_tiled)
 __kernel void scan_naive(
     const __global T* inArray,
-    __global T* outArray, uint N, uint offset)
+    __global T* outArray, ulong N, ulong offset, ulong base)
 {
-  uint i = get_global_id(0);
+  IDX i = base + get_global_id(0);
   if (i >= N)
     return;
   if (i < offset)
@@ -15,64 +17,83 @@ __kernel void scan_naive(
 __kernel void shift(
     const __global T* inArray,
     __global T* outArray,
-    uint N)
+    ulong N, ulong base)
 {
-  uint i = get_global_id(0);
-  outArray[i] = i > 0 && i < N ? inArray[i-1] : IDENTITY;
+  IDX i = base + get_global_id(0);
+  if (i >= N)
+    return;
+  outArray[i] = i > 0 ? inArray[i-1] : IDENTITY;
 }
 
-#define UNROLL
-#define NUM_BANKS      32
-#define NUM_BANKS_LOG    5
-#define SIMD_GROUP_SIZE    32
+// Work-efficient exclusive scan in two kernels per level. Every work group
+// owns a tile of SCAN_ITEMS elements per work item: scan_reduce computes the
+// total of every tile, these totals are scanned recursively, and scan_down
+// then scans every tile starting from the scanned total of the tiles before
+// it. Every element is thus read twice and written once.
 
-// Bank conflicts
-#define AVOID_BANK_CONFLICTS 1
-#if AVOID_BANK_CONFLICTS
-  #define OFFSET(x) ((x) + ((x) / NUM_BANKS))
-#else
-  #define OFFSET(x) (x)
-#endif
+#define SCAN_TILE (LOCAL_SIZE * SCAN_ITEMS)
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-__kernel void scan(
-    __global uint* array, __global uint* higherLevelArray,
-    __local uint* localBlock)
-{
-  uint blockSize = get_local_size(0);
-  uint gidx = get_global_id(0) + blockSize * get_group_id(0);
-  uint lidx = get_local_id(0);
-  localBlock[OFFSET(lidx)] = array[gidx + lidx] + array[gidx + lidx + 1];
-  // up sweep
-  uint stride;
-  for (stride = 2; stride <= blockSize; stride <<= 1) {
-    barrier(CLK_LOCAL_MEM_FENCE);
-    if (lidx % stride == stride - 1) {
-      localBlock[OFFSET(lidx)] += localBlock[OFFSET(lidx - (stride >> 1))];
-    }
-  }
+// Loads the tile of this work group into local memory, padding it with
+// IDENTITY, and combines the SCAN_ITEMS elements of this work item
+T load_tile(const __global T* in, IDX size, IDX lo, __local T* tile) {
+  uint lid = get_local_id(0);
+  for (uint i = lid; i < SCAN_TILE; i += LOCAL_SIZE)
+    tile[i] = lo + i < size ? in[lo + i] : IDENTITY;
   barrier(CLK_LOCAL_MEM_FENCE);
-  if (lidx == 0) {
-    higherLevelArray[get_group_id(0)] = localBlock[OFFSET(blockSize - 1)];
-    localBlock[OFFSET(blockSize - 1)] = 0;
-  }
-  // down sweep
-  for (stride = blockSize; stride >= 2; stride >>= 1) {
+  T acc = IDENTITY;
+  for (uint k = 0; k < SCAN_ITEMS; ++k)
+    acc = combine(acc, tile[lid * SCAN_ITEMS + k]);
+  return acc;
+}
+
+// inclusive scan of x over the work group
+T scan_group(__local T* tmp, T x) {
+  uint lid = get_local_id(0);
+  tmp[lid] = x;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (uint offset = 1; offset < LOCAL_SIZE; offset <<= 1) {
+    T y = lid >= offset ? tmp[lid - offset] : IDENTITY;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    tmp[lid] = combine(y, tmp[lid]);
     barrier(CLK_LOCAL_MEM_FENCE);
-    if (lidx % stride == stride - 1) {
-      uint left = localBlock[OFFSET(lidx - (stride >> 1))];
-      localBlock[OFFSET(lidx - (stride >> 1))] = localBlock[OFFSET(lidx)];
-      localBlock[OFFSET(lidx)] += left;
-    }
   }
-  array[gidx + lidx + 1] = localBlock[OFFSET(lidx)] + array[gidx + lidx];
-  array[gidx + lidx] = localBlock[OFFSET(lidx)];
+  return tmp[lid];
 }
 
+__kernel void scan_reduce(
+    const __global T* in, ulong size, __global T* sums, ulong base)
+{
+  __local T tile[SCAN_TILE];
+  __local T tmp[LOCAL_SIZE];
+  IDX group = base / LOCAL_SIZE + get_group_id(0);
+  T total = scan_group(tmp, load_tile(in, size, group * SCAN_TILE, tile));
+  if (get_local_id(0) == LOCAL_SIZE - 1)
+    sums[group] = total;
+}
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// removed localBlock because we just use a read with an offset on the CPU side
-__kernel void scan_add(__global uint* higherLevelArray, __global uint* array)
+// sums holds the exclusive scan of the tile totals, unless there is only
+// a single tile
+__kernel void scan_down(
+    __global T* buf, ulong size_, const __global T* sums, uint use_sums,
+    ulong base)
 {
-  array[get_global_id(0)] += higherLevelArray[get_group_id(0) / 2];
+  __local T tile[SCAN_TILE];
+  __local T tmp[LOCAL_SIZE];
+  IDX size = size_, group = base / LOCAL_SIZE + get_group_id(0);
+  IDX lo = group * SCAN_TILE;
+  uint lid = get_local_id(0);
+  scan_group(tmp, load_tile(buf, size, lo, tile));
+  T acc = lid > 0 ? tmp[lid - 1] : IDENTITY;
+  if (use_sums)
+    acc = combine(sums[group], acc);
+  for (uint k = 0; k < SCAN_ITEMS; ++k) {
+    uint i = lid * SCAN_ITEMS + k;
+    T y = tile[i];
+    tile[i] = acc;
+    acc = combine(acc, y);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (uint i = lid; i < SCAN_TILE; i += LOCAL_SIZE)
+    if (lo + i < size)
+      buf[lo + i] = tile[i];
 }
@@ -14,53 +14,99 @@ namespace ocl_code {
 }
 
 namespace ocl_primitives {
-  void scan_naive(
+  // elements per work item in scan
+  const uint32_t SCAN_ITEMS = 4;
+
+  struct ScanKernels {
+    cl::Kernel naive, shift, reduce, down;
+  };
+
+  // kernels for buffers of up to size elements
+  ScanKernels scan_kernels(
+      OpenCLApp& cl,
+      const OpenCLConfig& clcfg,
+      const std::string& type, const std::string& combine, const std::string& id,
+      uint64_t size)
+  {
+    std::string idx = OpenCLApp::index_type(size);
+    auto defines = std::string()
+      + "#define T " + type + "\n"
+      + "#define IDX " + idx + "\n"
+      + "T combine(T x, T y);\n"
+      + "T combine(T x, T y) { return (" + combine + "); }\n"
+      + "#define IDENTITY (" + id + ")\n"
+      + "#define LOCAL_SIZE " + std::to_string(clcfg.local_size) + "\n"
+      + "#define SCAN_ITEMS " + std::to_string(SCAN_ITEMS) + "\n";
+    auto prog = cl.build_program(std::vector<std::string> {
+      defines,
+      ocl_code::scan_cl_str
+    });
+    ScanKernels k;
+    k.naive = cl.get_kernel(prog, "scan_naive");
+    k.shift = cl.get_kernel(prog, "shift");
+    k.reduce = cl.get_kernel(prog, "scan_reduce");
+    k.down = cl.get_kernel(prog, "scan_down");
+    return k;
+  }
+
+  // In-place exclusive scan of buf with the associative operator combine,
+  // whose identity is id. Needs O(size) work: the totals of all tiles of
+  // local_size * SCAN_ITEMS elements are computed and scanned recursively,
+  // then every tile is scanned on its own.
+  void scan(
       OpenCLApp& cl,
       const OpenCLConfig& clcfg,
-      cl::Buffer buf, uint32_t element_size, uint32_t size,
+      cl::Buffer buf, uint32_t element_size, uint64_t size,
       const std::string& type, const std::string& combine, const std::string& id)
   {
-    double t0 = utils::get_time();
-    static std::map<std::tuple<std::string, std::string, std::string>,
-      std::tuple<cl::Kernel, cl::Kernel>> memo;
-    auto it = memo.find(std::tie(type, combine, id));
-    cl::Kernel kernel_naive, kernel_shift;
-    if (it == std::end(memo)) {
-      auto defines = std::string()
-        + "#define T " + type + "\n"
-        + "T combine(T x, T y);\n"
-        + "T combine(T x, T y) { return (" + combine + "); }\n"
-        + "#define IDENTITY (" + id + ")\n";
-      auto prog = cl.build_program(std::vector<std::string> {
-        defines,
-        ocl_code::scan_cl_str
-      });
-      kernel_naive = cl.get_kernel(prog, "scan_naive");
-      kernel_shift = cl.get_kernel(prog, "shift");
-      memo[std::tie(type, combine, id)] = std::tie(kernel_naive, kernel_shift);
-    } else {
-      std::tie(kernel_naive, kernel_shift) = it->second;
+    if (size == 0)
+      return;
+    ScanKernels k = scan_kernels(cl, clcfg, type, combine, id, size);
+    uint64_t tile = clcfg.local_size * SCAN_ITEMS;
+    uint64_t groups = (size + tile - 1) / tile;
+    cl::Buffer sums = buf;
+    if (groups > 1) {
+      sums = cl.alloc<char>(groups * element_size);
+      k.reduce.setArg(0, buf);
+      k.reduce.setArg(1, (cl_ulong)size);
+      k.reduce.setArg(2, sums);
+      cl.run_kernel_tiled(k.reduce, 3, groups * clcfg.local_size, clcfg.local_size);
+      scan(cl, clcfg, sums, element_size, groups, type, combine, id);
     }
+    // the recursion has changed the arguments of the shared kernels
+    k.down.setArg(0, buf);
+    k.down.setArg(1, (cl_ulong)size);
+    k.down.setArg(2, sums);
+    k.down.setArg(3, (cl_uint)(groups > 1));
+    cl.run_kernel_tiled(k.down, 4, groups * clcfg.local_size, clcfg.local_size);
+  }
+
+  // Hillis-Steele scan, which needs O(size log size) work. Kept as a
+  // reference for test_scan.
+  void scan_naive(
+      OpenCLApp& cl,
+      const OpenCLConfig& clcfg,
+      cl::Buffer buf, uint32_t element_size, uint64_t size,
+      const std::string& type, const std::string& combine, const std::string& id)
+  {
+    ScanKernels k = scan_kernels(cl, clcfg, type, combine, id, size);
+    cl::Kernel kernel_naive = k.naive, kernel_shift = k.shift;
     cl::Buffer ping = buf;
     cl::Buffer pong = cl.alloc<char>(size * element_size);
     int cnt = 0;
-    for (uint32_t offset = 1; offset < size; offset *= 2) {
+    for (uint64_t offset = 1; offset < size; offset *= 2) {
       cnt++;
       kernel_naive.setArg(0, ping);
       kernel_naive.setArg(1, pong);
-      kernel_naive.setArg(2, (cl_uint)size);
-      kernel_naive.setArg(3, (cl_uint)offset);
-      cl.run_kernel(kernel_naive,
-          cl::NDRange(utils::round_to_multiple(size, clcfg.local_size)),
-          cl::NDRange(clcfg.local_size));
+      kernel_naive.setArg(2, (cl_ulong)size);
+      kernel_naive.setArg(3, (cl_ulong)offset);
+      cl.run_kernel_tiled(kernel_naive, 4, size, clcfg.local_size);
       std::swap(ping, pong);
     }
     kernel_shift.setArg(0, ping);
     kernel_shift.setArg(1, pong);
-    kernel_shift.setArg(2, (cl_uint)size);
-    cl.run_kernel(kernel_shift,
-        cl::NDRange(utils::round_to_multiple(size, clcfg.local_size)),
-        cl::NDRange(clcfg.local_size));
+    kernel_shift.setArg(2, (cl_ulong)size);
+    cl.run_kernel_tiled(kernel_shift, 3, size, clcfg.local_size);
     cnt++;
     std::swap(ping, pong);
     if (cnt % 2)
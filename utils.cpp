@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <thread>
 #include <sys/time.h>
 #include "utils.h"
 
@@ -34,4 +35,8 @@ void Progress::finish() {
   cout << "\rProgress: 100%    " << endl;
 }
 
+unsigned default_num_threads() {
+  return max(1u, thread::hardware_concurrency());
+}
+
 }
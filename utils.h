@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace utils {
 
@@ -34,4 +38,63 @@ T round_to_multiple(T a, T b) {
   return (a + b - 1) / b * b;
 }
 
+// number of bits needed to represent x
+inline int bit_width(std::uint64_t x) {
+  int bits = 0;
+  while (bits < 64 && (x >> bits))
+    bits++;
+  return bits;
+}
+
+unsigned default_num_threads();
+
+// Hands out consecutive ranges of [begin, end) to whoever asks first, so
+// that workers of different speed get work in proportion to their
+// throughput.
+class WorkQueue {
+  std::atomic<std::uint64_t> next;
+  std::uint64_t begin_, end_;
+
+public:
+  WorkQueue(std::uint64_t begin, std::uint64_t end)
+    : next(begin), begin_(begin), end_(end) {}
+
+  // Takes up to n items as [lo, hi), returns false if none are left
+  bool take(std::uint64_t n, std::uint64_t& lo, std::uint64_t& hi) {
+    lo = next.fetch_add(n);
+    if (lo >= end_)
+      return false;
+    hi = std::min(end_, lo + n);
+    return true;
+  }
+
+  std::uint64_t size() const { return end_ - begin_; }
+  // items handed out so far
+  std::uint64_t taken() const { return std::min(end_, next.load()) - begin_; }
+};
+
+// Runs f(thread_id, lo, hi) for consecutive chunks of [begin, end) on
+// num_threads threads. Chunks are handed out on demand, so faster threads
+// just grab more of them and nobody is left waiting for a straggler.
+template <typename F>
+void parallel_for(unsigned num_threads, std::uint64_t begin, std::uint64_t end,
+    std::uint64_t chunk, F f)
+{
+  std::atomic<std::uint64_t> next(begin);
+  auto worker = [&](unsigned thread_id) {
+    for (;;) {
+      std::uint64_t lo = next.fetch_add(chunk);
+      if (lo >= end)
+        break;
+      f(thread_id, lo, std::min(end, lo + chunk));
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker, i);
+  worker(0);
+  for (auto& t : threads)
+    t.join();
+}
+
 }